@@ -0,0 +1,324 @@
+// Benchmark of memlz against a memcpy() baseline that is measured in the same run. Reports
+// speed and ratio for one-shot and streaming compression at several packet sizes, on
+// synthetic data and on files given on the command line.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sched.h>
+#endif
+
+#include "../memlz.h"
+
+static const size_t packet_lens[] = { 1024, 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+static int repetitions = 7;
+static int csv = 0;
+static int failed = 0;
+
+static double now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#endif
+}
+
+// Run on a single core so that the numbers do not depend on migrations between cores
+static void pin(int core) {
+#if defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "Could not pin to core %d\n", core);
+    }
+#else
+    (void)core;
+#endif
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void gen_zeros(uint8_t* p, size_t n) {
+    memset(p, 0, n);
+}
+
+static void gen_random(uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (uint8_t)rng();
+    }
+}
+
+// Words of a small vocabulary with a skewed distribution, like natural language text
+static void gen_text(uint8_t* p, size_t n) {
+    static const char* words[] = { "the ", "of ", "and ", "to ", "in ", "is ", "that ", "for ", "it ", "as ", "was ",
+        "with ", "be ", "by ", "on ", "not ", "he ", "this ", "are ", "or ", "his ", "from ", "at ", "which ", "but ",
+        "have ", "an ", "had ", "they ", "you ", "were ", "their ", "one ", "all ", "we ", "can ", "her ", "has ",
+        "there ", "been ", "if ", "more ", "when ", "will ", "would ", "who ", "so ", "no ", "compression ", "memory ",
+        "buffer ", "stream ", "packet ", "library ", "speed ", "ratio ", "table ", "hash ", "word ", "block ", ".\n" };
+    const size_t count = sizeof(words) / sizeof(words[0]);
+    size_t i = 0;
+    while (i < n) {
+        uint64_t r = rng();
+        const char* w = words[(r % count) * ((r >> 32) % count) / count];
+        for (size_t k = 0; w[k] && i < n; k++) {
+            p[i++] = (uint8_t)w[k];
+        }
+    }
+}
+
+// Rows of 32-bit integer columns where each column changes slowly, like sensor data or metrics
+static void gen_numeric(uint8_t* p, size_t n) {
+    uint32_t columns[8] = { 1000, 500000, 7, 123456789, 0, 42, 65535, 1 << 20 };
+    size_t i = 0;
+    while (i + 32 <= n) {
+        for (int c = 0; c < 8; c++) {
+            uint64_t r = rng();
+            columns[c] += (r & 3) == 0 ? (uint32_t)(r >> 32) % 16 : 0;
+            memcpy(p + i, &columns[c], 4);
+            i += 4;
+        }
+    }
+    memset(p + i, 0, n - i);
+}
+
+static void gen_json(uint8_t* p, size_t n) {
+    static const char* cities[] = { "Copenhagen", "Berlin", "Madrid", "Oslo", "Paris", "Rome", "Vienna", "Warsaw" };
+    char row[256];
+    size_t i = 0;
+    unsigned id = 1;
+    while (i < n) {
+        uint64_t r = rng();
+        int len = snprintf(row, sizeof(row), "{\"id\": %u, \"name\": \"user%u\", \"city\": \"%s\", \"active\": %s, \"score\": %u},\n",
+            id++, (unsigned)(r % 100000), cities[(r >> 20) % 8], (r >> 30) & 1 ? "true" : "false", (unsigned)(r >> 40) % 1000);
+        for (int k = 0; k < len && i < n; k++) {
+            p[i++] = (uint8_t)row[k];
+        }
+    }
+}
+
+typedef struct result {
+    double comp;
+    double decomp;
+    size_t compressed;
+} result;
+
+static double best_of(double a, double b) {
+    return a < b ? a : b;
+}
+
+// Compress and decompress the data as one buffer, or as packets of packet_len bytes of one
+// stream if packet_len is nonzero
+static result run(const uint8_t* data, size_t len, size_t packet_len, uint8_t* compressed, uint8_t* decompressed, memlz_state* state) {
+    result res = { 1e30, 1e30, 0 };
+    const size_t packet = packet_len ? packet_len : len;
+
+    // The first round is a warmup and is not timed
+    for (int r = 0; r <= repetitions; r++) {
+        double t0 = now();
+        size_t out = 0;
+        if (packet_len) {
+            memlz_reset(state);
+            for (size_t i = 0; i < len; i += packet) {
+                out += memlz_stream_compress(compressed + out, data + i, (len - i < packet ? len - i : packet), state);
+            }
+        }
+        else {
+            out = memlz_compress(compressed, data, len);
+        }
+        double t1 = now();
+
+        size_t in = 0;
+        if (packet_len) {
+            memlz_reset(state);
+            for (size_t i = 0; i < len; i += packet) {
+                size_t n = memlz_stream_decompress(decompressed + i, compressed + in, state);
+                if (n != (len - i < packet ? len - i : packet)) {
+                    break;
+                }
+                in += memlz_compressed_len(compressed + in);
+            }
+        }
+        else {
+            memlz_decompress(decompressed, compressed);
+        }
+        double t2 = now();
+
+        if (memcmp(data, decompressed, len)) {
+            fprintf(stderr, "Decompressed data differs from the original\n");
+            failed = 1;
+        }
+        memset(decompressed, 0, len);
+
+        if (r > 0) {
+            res.comp = best_of(res.comp, t1 - t0);
+            res.decomp = best_of(res.decomp, t2 - t1);
+        }
+        res.compressed = out;
+    }
+    return res;
+}
+
+static double run_memcpy(const uint8_t* data, size_t len, uint8_t* dst) {
+    double best = 1e30;
+    for (int r = 0; r <= repetitions; r++) {
+        double t0 = now();
+        memcpy(dst, data, len);
+        double t1 = now();
+        if (r > 0) {
+            best = best_of(best, t1 - t0);
+        }
+    }
+    return best;
+}
+
+static double mbs(size_t len, double seconds) {
+    return seconds > 0 ? (double)len / seconds / 1e6 : 0;
+}
+
+static void report(const char* name, const char* mode, size_t len, result res, double memcpy_time) {
+    const double ratio = len ? (double)res.compressed / (double)len : 0;
+    if (csv) {
+        printf("%s,%s,%zu,%.4f,%.0f,%.0f,%.0f\n", name, mode, len, ratio, mbs(len, res.comp), mbs(len, res.decomp), mbs(len, memcpy_time));
+    }
+    else {
+        printf("%-16.16s %-12s %6.1f%% %9.0f MB/s %5.1f%% %9.0f MB/s %5.1f%%\n", name, mode, 100 * ratio,
+            mbs(len, res.comp), 100 * memcpy_time / res.comp, mbs(len, res.decomp), 100 * memcpy_time / res.decomp);
+    }
+}
+
+static void bench(const char* name, const uint8_t* data, size_t len) {
+    size_t packets = len / packet_lens[0] + 1;
+    uint8_t* compressed = (uint8_t*)malloc(packets * memlz_max_compressed_len(packet_lens[0]) + memlz_max_compressed_len(len));
+    uint8_t* decompressed = (uint8_t*)calloc(len + 1, 1);
+    memlz_state* state = (memlz_state*)malloc(sizeof(memlz_state));
+    if (!compressed || !decompressed || !state) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    double memcpy_time = run_memcpy(data, len, decompressed);
+    result base = { memcpy_time, memcpy_time, len };
+    report(name, "memcpy", len, base, memcpy_time);
+    report(name, "one-shot", len, run(data, len, 0, compressed, decompressed, state), memcpy_time);
+
+    for (size_t i = 0; i < sizeof(packet_lens) / sizeof(packet_lens[0]); i++) {
+        if (packet_lens[i] < len) {
+            char mode[32];
+            snprintf(mode, sizeof(mode), "stream %zuK", packet_lens[i] / 1024);
+            report(name, mode, len, run(data, len, packet_lens[i], compressed, decompressed, state), memcpy_time);
+        }
+    }
+
+    free(compressed);
+    free(decompressed);
+    free(state);
+}
+
+int main(int argc, char* argv[]) {
+    size_t len = 64 * 1024 * 1024;
+    int core = 0;
+    int files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            len = (size_t)atol(argv[++i]) * 1024 * 1024;
+        }
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            core = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-csv")) {
+            csv = 1;
+        }
+        else if (argv[i][0] == '-') {
+            printf("Usage: bench [-r repetitions] [-s synthetic MB] [-c core] [-csv] [files...]\n\n"
+                "Benchmarks the given files, or synthetic data if there are none. Speeds are the best of\n"
+                "the repetitions after one warmup run, and percentages are relative to memcpy().\n");
+            return 1;
+        }
+        else {
+            files++;
+        }
+    }
+    repetitions = repetitions < 1 ? 1 : repetitions;
+    pin(core);
+
+    if (csv) {
+        printf("data,mode,len,ratio,compress_mbs,decompress_mbs,memcpy_mbs\n");
+    }
+    else {
+        printf("%-16s %-12s %7s %14s %6s %14s %6s\n", "data", "mode", "ratio", "compress", "", "decompress", "");
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            i += strcmp(argv[i], "-csv") ? 1 : 0;
+            continue;
+        }
+        FILE* f = fopen(argv[i], "rb");
+        if (!f) {
+            fprintf(stderr, "Could not open %s\n", argv[i]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        long n = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        uint8_t* data = (uint8_t*)malloc(n > 0 ? (size_t)n : 1);
+        if (!data || fread(data, 1, (size_t)n, f) != (size_t)n) {
+            fprintf(stderr, "Could not read %s\n", argv[i]);
+            return 1;
+        }
+        fclose(f);
+        const char* name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        bench(name, data, (size_t)n);
+        free(data);
+    }
+
+    if (files == 0) {
+        static const struct {
+            const char* name;
+            void (*gen)(uint8_t*, size_t);
+        } sets[] = { { "zeros", gen_zeros }, { "random", gen_random }, { "text", gen_text }, { "numeric", gen_numeric }, { "json", gen_json } };
+
+        uint8_t* data = (uint8_t*)malloc(len);
+        if (!data) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+            sets[i].gen(data, len);
+            bench(sets[i].name, data, len);
+        }
+        free(data);
+    }
+
+    return failed;
+}
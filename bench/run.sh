@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+# Builds and runs the benchmark. Arguments are passed on to it, for example files to benchmark
+# instead of the synthetic data, or -csv for output that can be compared between versions.
+set -euo pipefail
+
+cd "$(dirname "${BASH_SOURCE[0]}")"
+
+mkdir -p ../build
+${CC:-cc} -O2 bench.c -o ../build/bench
+
+../build/bench "$@"
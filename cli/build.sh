@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+# Builds the memlz command line tool into build/memlz. Set CC to use another compiler.
+set -euo pipefail
+
+cd "$(dirname "${BASH_SOURCE[0]}")"
+
+mkdir -p ../build
+${CC:-cc} -O2 memlz.c -o ../build/memlz -lpthread
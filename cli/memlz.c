@@ -0,0 +1,874 @@
+// Command line tool for memlz. Input is split into blocks that a reader passes to worker threads,
+// which compress or decompress them in parallel, and a writer outputs the results in the order of
+// the input. Each block is compressed into an independent packet, so the output is simply the
+// packets one after another and each of them can also be decompressed by memlz_decompress().
+// Files are memory mapped, and stdin and stdout can be used for pipes.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+#include "../memlz.h"
+
+// Exit codes
+#define EXIT_OK 0
+#define EXIT_USAGE 1
+#define EXIT_IO 2
+#define EXIT_CORRUPT 3
+#define EXIT_MEMORY 4
+
+#define MODE_COMPRESS 0
+#define MODE_DECOMPRESS 1
+#define MODE_TEST 2
+
+#define SLOT_EMPTY 0
+#define SLOT_READY 1
+#define SLOT_DONE 2
+
+#define MIN_BLOCK ((size_t)64 * 1024)
+#define MAX_BLOCK ((size_t)1024 * 1024 * 1024)
+#define MAX_THREADS 256
+
+static double now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#endif
+}
+
+static size_t cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+// The few thread primitives that the pipeline needs, on top of Win32 or pthreads
+#ifdef _WIN32
+typedef HANDLE thread;
+typedef CRITICAL_SECTION mutex;
+typedef CONDITION_VARIABLE condition;
+
+static void mutex_init(mutex* m) { InitializeCriticalSection(m); }
+static void mutex_free(mutex* m) { DeleteCriticalSection(m); }
+static void lock(mutex* m) { EnterCriticalSection(m); }
+static void unlock(mutex* m) { LeaveCriticalSection(m); }
+static void condition_init(condition* c) { InitializeConditionVariable(c); }
+static void condition_free(condition* c) { (void)c; }
+static void condition_wait(condition* c, mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void condition_wake(condition* c) { WakeAllConditionVariable(c); }
+
+typedef struct thread_start {
+    void (*run)(void*);
+    void* arg;
+} thread_start;
+
+static DWORD WINAPI thread_main(LPVOID p) {
+    thread_start s = *(thread_start*)p;
+    free(p);
+    s.run(s.arg);
+    return 0;
+}
+
+static int thread_create(thread* t, void (*run)(void*), void* arg) {
+    thread_start* s = (thread_start*)malloc(sizeof(thread_start));
+    if (!s) {
+        return 0;
+    }
+    s->run = run;
+    s->arg = arg;
+    *t = CreateThread(0, 0, thread_main, s, 0, 0);
+    if (!*t) {
+        free(s);
+        return 0;
+    }
+    return 1;
+}
+
+static void thread_join(thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+#else
+typedef pthread_t thread;
+typedef pthread_mutex_t mutex;
+typedef pthread_cond_t condition;
+
+static void mutex_init(mutex* m) { pthread_mutex_init(m, 0); }
+static void mutex_free(mutex* m) { pthread_mutex_destroy(m); }
+static void lock(mutex* m) { pthread_mutex_lock(m); }
+static void unlock(mutex* m) { pthread_mutex_unlock(m); }
+static void condition_init(condition* c) { pthread_cond_init(c, 0); }
+static void condition_free(condition* c) { pthread_cond_destroy(c); }
+static void condition_wait(condition* c, mutex* m) { pthread_cond_wait(c, m); }
+static void condition_wake(condition* c) { pthread_cond_broadcast(c); }
+
+typedef struct thread_start {
+    void (*run)(void*);
+    void* arg;
+} thread_start;
+
+static void* thread_main(void* p) {
+    thread_start s = *(thread_start*)p;
+    free(p);
+    s.run(s.arg);
+    return 0;
+}
+
+static int thread_create(thread* t, void (*run)(void*), void* arg) {
+    thread_start* s = (thread_start*)malloc(sizeof(thread_start));
+    if (!s) {
+        return 0;
+    }
+    s->run = run;
+    s->arg = arg;
+    if (pthread_create(t, 0, thread_main, s) != 0) {
+        free(s);
+        return 0;
+    }
+    return 1;
+}
+
+static void thread_join(thread t) {
+    pthread_join(t, 0);
+}
+#endif
+
+// Input is a file that is mapped into memory, a buffer, or a stream such as stdin that is read
+// block by block when it cannot be mapped
+typedef struct input {
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+    FILE* file;
+    int mapped;
+    // Bytes that were read from the stream to find the length of a packet but belong to it
+    uint8_t head[32];
+    size_t head_len;
+} input;
+
+static void input_buffer(input* in, const uint8_t* data, size_t len) {
+    memset(in, 0, sizeof(input));
+    in->data = data;
+    in->len = len;
+}
+
+static int input_open(input* in, const char* path) {
+    memset(in, 0, sizeof(input));
+    if (!path || !strcmp(path, "-")) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        in->file = stdin;
+        return 1;
+    }
+    in->file = fopen(path, "rb");
+    if (!in->file) {
+        return 0;
+    }
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(in->file));
+    LARGE_INTEGER size;
+    if (GetFileType(h) == FILE_TYPE_DISK && GetFileSizeEx(h, &size) && size.QuadPart > 0 && (uint64_t)size.QuadPart <= SIZE_MAX) {
+        HANDLE mapping = CreateFileMappingA(h, 0, PAGE_READONLY, 0, 0, 0);
+        void* p = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (p) {
+            in->data = (const uint8_t*)p;
+            in->len = (size_t)size.QuadPart;
+            in->mapped = 1;
+        }
+    }
+#else
+    struct stat st;
+    if (!fstat(fileno(in->file), &st) && S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(in->file), 0);
+        if (p != MAP_FAILED) {
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            in->data = (const uint8_t*)p;
+            in->len = (size_t)st.st_size;
+            in->mapped = 1;
+        }
+    }
+#endif
+    return 1;
+}
+
+static void input_close(input* in) {
+    if (in->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile((void*)in->data);
+#else
+        munmap((void*)in->data, in->len);
+#endif
+    }
+    if (in->file && in->file != stdin) {
+        fclose(in->file);
+    }
+}
+
+// A stream reads from the file, and everything else from the data
+static int input_stream(const input* in) {
+    return in->file && !in->mapped;
+}
+
+// Output goes to a file, to a buffer, or nowhere when only testing
+typedef struct output {
+    FILE* file;
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+} output;
+
+static int output_write(output* out, const uint8_t* p, size_t n) {
+    if (out->file) {
+        return fwrite(p, 1, n, out->file) == n;
+    }
+    if (out->data) {
+        if (n > out->capacity - out->len) {
+            return 0;
+        }
+        memcpy(out->data + out->len, p, n);
+        out->len += n;
+    }
+    return 1;
+}
+
+// A block that travels from the reader to a worker and on to the writer. Slots are used in turn
+// so that the writer can find the next block of the input
+typedef struct slot {
+    int status;
+    int error;
+    const uint8_t* src;
+    size_t len;
+    size_t decompressed_len;
+    uint8_t* buffer;
+    size_t buffer_capacity;
+    uint8_t* result;
+    size_t result_len;
+    size_t result_capacity;
+} slot;
+
+typedef struct pipeline {
+    int mode;
+    size_t block;
+    int checksum;
+    int long_range;
+    input* in;
+    output* out;
+    slot* slots;
+    size_t count;
+    // Number of blocks that were read, taken by a worker and written
+    size_t read;
+    size_t taken;
+    size_t written;
+    int end;
+    int error;
+    uint64_t input_bytes;
+    mutex m;
+    condition c;
+} pipeline;
+
+static void fail(pipeline* p, int error) {
+    lock(&p->m);
+    if (!p->error) {
+        p->error = error;
+    }
+    condition_wake(&p->c);
+    unlock(&p->m);
+}
+
+static int grow(uint8_t** buffer, size_t* capacity, size_t len) {
+    if (len <= *capacity) {
+        return 1;
+    }
+    free(*buffer);
+    *buffer = (uint8_t*)malloc(len);
+    *capacity = *buffer ? len : 0;
+    return *buffer != 0;
+}
+
+static size_t read_stream(input* in, uint8_t* dst, size_t len) {
+    size_t n = 0;
+    while (n < len) {
+        size_t r = fread(dst + n, 1, len - n, in->file);
+        if (r == 0) {
+            break;
+        }
+        n += r;
+    }
+    return n;
+}
+
+// Find the next packet in the input and validate its header, which memlz_compressed_len() and
+// memlz_decompressed_len() read without checking it. Returns 1 for a packet, 0 at the end of the
+// input, or an exit code
+static int read_packet(pipeline* p, slot* s) {
+    input* in = p->in;
+    uint8_t header[32] = { 0 };
+    size_t available;
+    if (input_stream(in)) {
+        in->head_len += read_stream(in, in->head + in->head_len, memlz_header_len() - in->head_len);
+        if (ferror(in->file)) {
+            return EXIT_IO;
+        }
+        memcpy(header, in->head, in->head_len);
+        available = in->head_len;
+    }
+    else {
+        available = in->len - in->pos;
+        memcpy(header, in->data + in->pos, available < memlz_header_len() ? available : memlz_header_len());
+    }
+    if (available == 0) {
+        return 0;
+    }
+
+    const size_t compressed_len = memlz_compressed_len(header);
+    const size_t decompressed_len = memlz_decompressed_len(header);
+    if (compressed_len == 0 || decompressed_len > MAX_BLOCK || compressed_len > memlz_max_compressed_len(decompressed_len)) {
+        return EXIT_CORRUPT;
+    }
+    s->len = compressed_len;
+    s->decompressed_len = decompressed_len;
+
+    if (!input_stream(in)) {
+        if (compressed_len > available) {
+            return EXIT_CORRUPT;
+        }
+        s->src = in->data + in->pos;
+        in->pos += compressed_len;
+        return 1;
+    }
+
+    if (!grow(&s->buffer, &s->buffer_capacity, compressed_len)) {
+        return EXIT_MEMORY;
+    }
+    const size_t head = compressed_len < in->head_len ? compressed_len : in->head_len;
+    memcpy(s->buffer, in->head, head);
+    memmove(in->head, in->head + head, in->head_len - head);
+    in->head_len -= head;
+    if (read_stream(in, s->buffer + head, compressed_len - head) != compressed_len - head) {
+        return ferror(in->file) ? EXIT_IO : EXIT_CORRUPT;
+    }
+    s->src = s->buffer;
+    return 1;
+}
+
+// Returns 1 for a block, 0 at the end of the input, or an exit code
+static int read_block(pipeline* p, slot* s) {
+    input* in = p->in;
+    if (p->mode != MODE_COMPRESS) {
+        return read_packet(p, s);
+    }
+    if (!input_stream(in)) {
+        s->src = in->data + in->pos;
+        s->len = in->len - in->pos < p->block ? in->len - in->pos : p->block;
+        in->pos += s->len;
+        return s->len > 0;
+    }
+    if (!grow(&s->buffer, &s->buffer_capacity, p->block)) {
+        return EXIT_MEMORY;
+    }
+    s->src = s->buffer;
+    s->len = read_stream(in, s->buffer, p->block);
+    if (ferror(in->file)) {
+        return EXIT_IO;
+    }
+    return s->len > 0;
+}
+
+static void process(pipeline* p, slot* s, memlz_state* state) {
+    if (p->mode == MODE_COMPRESS) {
+        if (!grow(&s->result, &s->result_capacity, memlz_max_compressed_len(s->len))) {
+            s->error = EXIT_MEMORY;
+            return;
+        }
+        s->result_len = memlz_compress_with_state(s->result, s->src, s->len, state);
+        s->error = s->result_len ? 0 : EXIT_MEMORY;
+        return;
+    }
+    // Room for at least one byte so that an empty packet has a destination
+    if (!grow(&s->result, &s->result_capacity, s->decompressed_len + 1)) {
+        s->error = EXIT_MEMORY;
+        return;
+    }
+    s->result_len = memlz_decompress_with_state(s->result, s->src, state);
+    if (s->result_len != s->decompressed_len) {
+        // A packet with other options than the state can decode is not necessarily corrupt
+        s->result_len = memlz_decompress(s->result, s->src);
+    }
+    s->error = s->result_len == s->decompressed_len ? 0 : EXIT_CORRUPT;
+}
+
+static void worker(void* arg) {
+    pipeline* p = (pipeline*)arg;
+    memlz_state* state = (memlz_state*)malloc(sizeof(memlz_state));
+    if (!state) {
+        fail(p, EXIT_MEMORY);
+        return;
+    }
+    memlz_reset(state);
+    memlz_set_checksum(state, p->checksum);
+    memlz_set_long_range(state, p->long_range);
+
+    lock(&p->m);
+    for (;;) {
+        while (!p->error && p->taken == p->read && !p->end) {
+            condition_wait(&p->c, &p->m);
+        }
+        if (p->error || p->taken == p->read) {
+            break;
+        }
+        slot* s = &p->slots[p->taken % p->count];
+        p->taken++;
+        unlock(&p->m);
+
+        process(p, s, state);
+
+        lock(&p->m);
+        s->status = SLOT_DONE;
+        condition_wake(&p->c);
+    }
+    unlock(&p->m);
+    free(state);
+}
+
+static void writer(void* arg) {
+    pipeline* p = (pipeline*)arg;
+    lock(&p->m);
+    for (;;) {
+        slot* s = &p->slots[p->written % p->count];
+        while (!p->error && s->status != SLOT_DONE && !(p->end && p->written == p->read)) {
+            condition_wait(&p->c, &p->m);
+        }
+        if (p->error || s->status != SLOT_DONE) {
+            break;
+        }
+        unlock(&p->m);
+
+        int error = s->error;
+        if (!error && p->mode != MODE_TEST && !output_write(p->out, s->result, s->result_len)) {
+            error = EXIT_IO;
+        }
+
+        lock(&p->m);
+        if (error) {
+            p->error = p->error ? p->error : error;
+        }
+        p->input_bytes += p->mode == MODE_COMPRESS ? s->len : s->decompressed_len;
+        s->status = SLOT_EMPTY;
+        p->written++;
+        condition_wake(&p->c);
+    }
+    unlock(&p->m);
+}
+
+// Run the reader on the calling thread together with the given number of workers and a writer.
+// Returns an exit code
+static int run(int mode, size_t block, size_t threads, int checksum, int long_range, input* in, output* out, uint64_t* bytes) {
+    pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.mode = mode;
+    p.block = block;
+    p.checksum = checksum;
+    p.long_range = long_range;
+    p.in = in;
+    p.out = out;
+    // Two blocks per worker lets the reader and the writer work ahead and behind
+    p.count = 2 * threads + 2;
+    p.slots = (slot*)calloc(p.count, sizeof(slot));
+    thread* workers = (thread*)malloc(threads * sizeof(thread));
+    if (!p.slots || !workers) {
+        free(p.slots);
+        free(workers);
+        return EXIT_MEMORY;
+    }
+    mutex_init(&p.m);
+    condition_init(&p.c);
+
+    size_t started = 0;
+    while (started < threads && thread_create(&workers[started], worker, &p)) {
+        started++;
+    }
+    thread write_thread;
+    const int writing = started > 0 && thread_create(&write_thread, writer, &p);
+    if (!writing) {
+        fail(&p, EXIT_MEMORY);
+    }
+
+    for (;;) {
+        slot* s = &p.slots[p.read % p.count];
+        lock(&p.m);
+        while (!p.error && s->status != SLOT_EMPTY) {
+            condition_wait(&p.c, &p.m);
+        }
+        const int stop = p.error;
+        unlock(&p.m);
+        if (stop) {
+            break;
+        }
+
+        const int r = read_block(&p, s);
+        if (r != 1) {
+            if (r != 0) {
+                fail(&p, r);
+            }
+            break;
+        }
+        lock(&p.m);
+        s->status = SLOT_READY;
+        s->error = 0;
+        p.read++;
+        condition_wake(&p.c);
+        unlock(&p.m);
+    }
+
+    lock(&p.m);
+    p.end = 1;
+    condition_wake(&p.c);
+    unlock(&p.m);
+    for (size_t t = 0; t < started; t++) {
+        thread_join(workers[t]);
+    }
+    if (writing) {
+        thread_join(write_thread);
+    }
+
+    for (size_t i = 0; i < p.count; i++) {
+        free(p.slots[i].buffer);
+        free(p.slots[i].result);
+    }
+    free(p.slots);
+    free(workers);
+    mutex_free(&p.m);
+    condition_free(&p.c);
+    if (bytes) {
+        *bytes = p.input_bytes;
+    }
+    return p.error;
+}
+
+static double mbs(uint64_t len, double seconds) {
+    return seconds > 0 ? (double)len / seconds / 1e6 : 0;
+}
+
+// Compress and decompress a file in memory with the pipeline, and report the best speeds of a
+// few runs
+static int bench(const char* path, size_t block, size_t threads, int checksum, int long_range) {
+    const int repetitions = 3;
+    input in;
+    if (!input_open(&in, path)) {
+        fprintf(stderr, "memlz: could not open %s\n", path);
+        return EXIT_IO;
+    }
+    if (!in.mapped) {
+        // Streams and empty files are read into memory first
+        size_t capacity = 0;
+        uint8_t* data = 0;
+        for (;;) {
+            if (in.len == capacity) {
+                capacity = capacity ? 2 * capacity : block;
+                uint8_t* grown = (uint8_t*)realloc(data, capacity);
+                if (!grown) {
+                    free(data);
+                    input_close(&in);
+                    return EXIT_MEMORY;
+                }
+                data = grown;
+            }
+            size_t r = fread(data + in.len, 1, capacity - in.len, in.file);
+            if (r == 0) {
+                break;
+            }
+            in.len += r;
+        }
+        in.data = data;
+    }
+
+    const size_t len = in.len;
+    output compressed = { 0, 0, 0, (len / block + 1) * memlz_max_compressed_len(block) };
+    output decompressed = { 0, 0, 0, len + 1 };
+    compressed.data = (uint8_t*)malloc(compressed.capacity);
+    decompressed.data = (uint8_t*)malloc(decompressed.capacity);
+    int error = compressed.data && decompressed.data ? 0 : EXIT_MEMORY;
+
+    double comp = 1e30;
+    double decomp = 1e30;
+    for (int r = 0; r < repetitions && !error; r++) {
+        input source;
+        input_buffer(&source, in.data, len);
+        compressed.len = 0;
+        double t0 = now();
+        error = run(MODE_COMPRESS, block, threads, checksum, long_range, &source, &compressed, 0);
+        double t1 = now();
+        input_buffer(&source, compressed.data, compressed.len);
+        decompressed.len = 0;
+        error = error ? error : run(MODE_DECOMPRESS, block, threads, checksum, long_range, &source, &decompressed, 0);
+        double t2 = now();
+        if (!error && (decompressed.len != len || memcmp(decompressed.data, in.data, len))) {
+            error = EXIT_CORRUPT;
+        }
+        comp = t1 - t0 < comp ? t1 - t0 : comp;
+        decomp = t2 - t1 < decomp ? t2 - t1 : decomp;
+    }
+
+    if (error) {
+        fprintf(stderr, "memlz: benchmark of %s failed\n", path);
+    }
+    else {
+        const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        printf("%-24.24s %14zu -> %14zu %6.1f%% %9.0f MB/s %9.0f MB/s\n", name, len, compressed.len,
+            len ? 100.0 * (double)compressed.len / (double)len : 0.0, mbs(len, comp), mbs(len, decomp));
+    }
+
+    free(compressed.data);
+    free(decompressed.data);
+    if (!in.mapped) {
+        free((void*)in.data);
+        in.data = 0;
+    }
+    input_close(&in);
+    return error;
+}
+
+// Parse a size such as 65536, 256K, 4M or 1G
+static size_t parse_size(const char* s) {
+    char* end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s || n > ((unsigned long long)1 << 40)) {
+        return 0;
+    }
+    const char unit = *end;
+    if (unit == 'K' || unit == 'k') {
+        n *= 1024;
+        end++;
+    }
+    else if (unit == 'M' || unit == 'm') {
+        n *= 1024 * 1024;
+        end++;
+    }
+    else if (unit == 'G' || unit == 'g') {
+        n *= 1024 * 1024 * 1024;
+        end++;
+    }
+    return *end || n > SIZE_MAX ? 0 : (size_t)n;
+}
+
+static int is_terminal(FILE* f) {
+#ifdef _WIN32
+    return _isatty(_fileno(f));
+#else
+    return isatty(fileno(f));
+#endif
+}
+
+// Only a regular file that failed to be written is removed, and not a device such as /dev/null
+static int is_regular(FILE* f) {
+#ifdef _WIN32
+    return GetFileType((HANDLE)_get_osfhandle(_fileno(f))) == FILE_TYPE_DISK;
+#else
+    struct stat st;
+    return !fstat(fileno(f), &st) && S_ISREG(st.st_mode);
+#endif
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "Usage: memlz [-c | -d | -t] [options] [input [output]]\n"
+        "       memlz -b [options] files...\n\n"
+        "  -c        Compress (default)\n"
+        "  -d        Decompress\n"
+        "  -t        Test that the input decompresses and that its checksums match\n"
+        "  -b        Benchmark compression and decompression of files in memory\n"
+        "  -B size   Block size from 64K to 1G (default 4M), which is compressed as one packet\n"
+        "  -T n      Number of worker threads (default one per CPU)\n"
+        "  -l        Long range matching of duplicate 4 KB pages within each block\n"
+        "  -n        Do not store checksums\n"
+        "  -f        Overwrite the output file, or write compressed data to a terminal\n\n"
+        "Input and output default to stdin and stdout, and - also means them. Exit codes are 0 on\n"
+        "success, 1 for usage errors, 2 for I/O errors, 3 for corrupt input and 4 if out of memory.\n");
+    return EXIT_USAGE;
+}
+
+int main(int argc, char* argv[]) {
+    int mode = MODE_COMPRESS;
+    int benchmark = 0;
+    size_t block = 4 * 1024 * 1024;
+    size_t threads = cpu_count();
+    int checksum = 1;
+    int long_range = 0;
+    int force = 0;
+    const char* paths[2] = { 0, 0 };
+    int files = 0;
+    int options = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if (options && !strcmp(a, "--")) {
+            options = 0;
+        }
+        else if (options && a[0] == '-' && a[1] && strlen(a) == 2) {
+            if (a[1] == 'c' || a[1] == 'd' || a[1] == 't') {
+                mode = a[1] == 'c' ? MODE_COMPRESS : a[1] == 'd' ? MODE_DECOMPRESS : MODE_TEST;
+            }
+            else if (a[1] == 'b') {
+                benchmark = 1;
+            }
+            else if (a[1] == 'B' && i + 1 < argc) {
+                block = parse_size(argv[++i]);
+                if (block < MIN_BLOCK || block > MAX_BLOCK) {
+                    fprintf(stderr, "memlz: block size must be from 64K to 1G\n");
+                    return EXIT_USAGE;
+                }
+            }
+            else if (a[1] == 'T' && i + 1 < argc) {
+                threads = (size_t)atoi(argv[++i]);
+                if (threads < 1 || threads > MAX_THREADS) {
+                    fprintf(stderr, "memlz: threads must be from 1 to %d\n", MAX_THREADS);
+                    return EXIT_USAGE;
+                }
+            }
+            else if (a[1] == 'l') {
+                long_range = 1;
+            }
+            else if (a[1] == 'n') {
+                checksum = 0;
+            }
+            else if (a[1] == 'f') {
+                force = 1;
+            }
+            else {
+                return usage();
+            }
+        }
+        else if (benchmark) {
+            files++;
+        }
+        else if (files < 2) {
+            paths[files++] = a;
+        }
+        else {
+            return usage();
+        }
+    }
+    threads = threads > MAX_THREADS ? MAX_THREADS : threads;
+
+    if (benchmark) {
+        if (files == 0) {
+            return usage();
+        }
+        printf("%-24s %14s    %14s %7s %14s %14s\n", "file", "input", "output", "ratio", "compress", "decompress");
+        int error = 0;
+        options = 1;
+        for (int i = 1; i < argc; i++) {
+            if (options && !strcmp(argv[i], "--")) {
+                options = 0;
+            }
+            else if (options && argv[i][0] == '-' && argv[i][1] && strlen(argv[i]) == 2) {
+                i += argv[i][1] == 'B' || argv[i][1] == 'T';
+            }
+            else {
+                int r = bench(argv[i], block, threads, checksum, long_range);
+                error = error ? error : r;
+            }
+        }
+        return error;
+    }
+    if (mode == MODE_TEST && files > 1) {
+        return usage();
+    }
+
+    input in;
+    if (!input_open(&in, paths[0])) {
+        fprintf(stderr, "memlz: could not open %s\n", paths[0]);
+        return EXIT_IO;
+    }
+
+    output out = { 0, 0, 0, 0 };
+    int regular = 0;
+    if (mode != MODE_TEST && paths[1] && strcmp(paths[1], "-")) {
+        FILE* existing = force ? 0 : fopen(paths[1], "rb");
+        const int overwrite = existing && is_regular(existing);
+        if (existing) {
+            fclose(existing);
+        }
+        if (overwrite) {
+            fprintf(stderr, "memlz: %s exists, use -f to overwrite it\n", paths[1]);
+            input_close(&in);
+            return EXIT_USAGE;
+        }
+        out.file = fopen(paths[1], "wb");
+        if (!out.file) {
+            fprintf(stderr, "memlz: could not create %s\n", paths[1]);
+            input_close(&in);
+            return EXIT_IO;
+        }
+        regular = is_regular(out.file);
+    }
+    else if (mode != MODE_TEST) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        if (mode == MODE_COMPRESS && !force && is_terminal(stdout)) {
+            fprintf(stderr, "memlz: compressed data is not written to a terminal, use -f to force it\n");
+            input_close(&in);
+            return EXIT_USAGE;
+        }
+        out.file = stdout;
+    }
+    if (out.file) {
+        // Blocks are written whole, so the buffer of the stream would only add a copy
+        setvbuf(out.file, 0, _IONBF, 0);
+    }
+
+    uint64_t bytes = 0;
+    int error = run(mode, block, threads, checksum, long_range, &in, &out, &bytes);
+    if (out.file && fflush(out.file)) {
+        error = error ? error : EXIT_IO;
+    }
+    if (out.file && out.file != stdout && fclose(out.file)) {
+        error = error ? error : EXIT_IO;
+    }
+    input_close(&in);
+
+    if (error) {
+        const char* what = error == EXIT_IO ? "I/O error" : error == EXIT_CORRUPT ? "corrupt input" : "out of memory";
+        fprintf(stderr, "memlz: %s\n", what);
+        if (regular) {
+            remove(paths[1]);
+        }
+    }
+    else if (mode == MODE_TEST) {
+        fprintf(stderr, "memlz: %llu bytes OK\n", (unsigned long long)bytes);
+    }
+    return error;
+}
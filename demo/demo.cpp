@@ -31,16 +31,35 @@ int main(int argc, char* argv[]) {
         }
     }
     else if (argc == 2 && argv[1][0] == 'd') {
-		size_t header = memlz_header_len();
-		
-        while(fread(in.data(), 1, header, stdin)) {
-            size_t len = memlz_compressed_len(in.data());
-            assert(fread(in.data() + header, 1, len - header, stdin) == len - header);
-			
-            size_t decompressed = memlz_stream_decompress(out.data(), in.data(), state.get());
-            assert(decompressed);			
-			
-            fwrite(out.data(), 1, decompressed, stdout);
+        // Read chunks that do not follow the packet boundaries and let a decoder find them
+        memlz_decoder decoder;
+        memlz_decoder_begin(&decoder, state.get(), out.data(), packet_len);
+        bool partial = false;
+        size_t r;
+
+        while ((r = fread(in.data(), 1, in.size(), stdin))) {
+            size_t pos = 0;
+            while (pos < r) {
+                size_t consumed;
+                int status = memlz_decoder_feed(&decoder, in.data() + pos, r - pos, &consumed);
+                if (status == MEMLZ_DECODER_ERROR) {
+                    std::cerr << "Malformed input\n";
+                    return 1;
+                }
+                pos += consumed;
+                partial = true;
+
+                if (status == MEMLZ_DECODER_DONE) {
+                    fwrite(out.data(), 1, memlz_decoder_ready(&decoder), stdout);
+                    memlz_decoder_begin(&decoder, state.get(), out.data(), packet_len);
+                    partial = false;
+                }
+            }
+        }
+
+        if (partial) {
+            std::cerr << "Truncated input\n";
+            return 1;
         }
     }
     else {
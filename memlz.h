@@ -17,7 +17,62 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#if !defined(MEMLZ_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(_MSC_VER))
+#define MEMLZ__X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif !defined(MEMLZ_NO_SIMD) && (defined(__aarch64__) || defined(_M_ARM64))
+#define MEMLZ__NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef MEMLZ_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+#endif
+
+#ifdef MEMLZ_POOL
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+#if defined(MEMLZ_STATS_CYCLES) && !defined(MEMLZ_STATS)
+#define MEMLZ_STATS
+#endif
+
+#if defined(MEMLZ_STATS_CYCLES) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(MEMLZ_STATS_CYCLES) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 typedef struct memlz_state memlz_state;
+typedef struct memlz_decoder memlz_decoder;
+
+/// A segment of input for memlz_stream_compressv(), which is struct iovec on POSIX systems
+#ifdef _WIN32
+typedef struct memlz_iovec {
+    void* iov_base;
+    size_t iov_len;
+} memlz_iovec;
+#else
+typedef struct iovec memlz_iovec;
+#endif
 
 /// Compress non-streaming data. The destination buffer must be at least
 /// memlz_max_compressed_len(len) large.
@@ -38,6 +93,12 @@ static size_t memlz_decompress(void* destination, const void* source);
 /// The destination buffer must be at least memlz_max_compressed_len(len) large.
 static size_t memlz_stream_compress(void* destination, const void* source, size_t len, memlz_state* state);
 
+/// Like memlz_stream_compress() but reads the input from count segments, such as a header,
+/// a payload and a trailer, instead of one buffer, so that they do not need to be copied
+/// together first. The output is the same as for the concatenated segments. The destination
+/// buffer must be at least memlz_max_compressed_len() of their total length large.
+static size_t memlz_stream_compressv(void* destination, const memlz_iovec* segments, size_t count, memlz_state* state);
+
 /// Decompress streaming data: First call memlz_reset(state) and then call
 /// memlz_stream_decompress() repeatedly in the same order for the compressed data as when
 /// you called memlz_compress(). 
@@ -47,6 +108,42 @@ static size_t memlz_stream_compress(void* destination, const void* source, size_
 /// Returns 0 if compressed data was malformed
 static size_t memlz_stream_decompress(void* destination, const void* source, memlz_state* state);
 
+/// Like memlz_stream_decompress() but for compressed data that is inside the destination buffer,
+/// so that one buffer of memlz_decompressed_len() + memlz_in_place_margin() bytes is enough.
+/// Read the compressed data into the end of that buffer, or anywhere that leaves at least that
+/// many bytes from the start of the buffer to the end of the compressed data.
+///
+/// Returns 0 if compressed data was malformed or if it starts too close to the destination
+static size_t memlz_stream_decompress_in_place(void* destination, const void* source, memlz_state* state);
+
+/// Returns the number of bytes that a buffer for memlz_stream_decompress_in_place() needs in
+/// addition to the decompressed data, which is about 4.7% of it plus 170 bytes
+static size_t memlz_in_place_margin(size_t decompressed_len);
+
+#define MEMLZ_DECODER_ERROR 0
+#define MEMLZ_DECODER_MORE 1
+#define MEMLZ_DECODER_DONE 2
+
+/// Decompress a packet of a stream like memlz_stream_decompress() does, but from compressed
+/// data that arrives in fragments of any length, such as network segments, so that it does
+/// not need to be collected in one buffer first. The decoder is a small struct that the
+/// caller allocates. Start each packet with memlz_decoder_begin(), which takes a state that
+/// is used like memlz_stream_decompress() would use it, and a destination buffer of capacity
+/// bytes.
+static void memlz_decoder_begin(memlz_decoder* decoder, memlz_state* state, void* destination, size_t capacity);
+
+/// Feed the next fragment of compressed data. Decompressed data is written to the destination
+/// as soon as each block of the fragment is complete. Bytes after the end of the packet are
+/// not consumed, so the rest of the fragment can be fed to the decoder of the next packet.
+/// The number of consumed bytes is stored in consumed unless consumed is 0.
+///
+/// Returns MEMLZ_DECODER_MORE if the packet needs more data, MEMLZ_DECODER_DONE if it is
+/// complete, or MEMLZ_DECODER_ERROR if it is malformed or larger than the capacity
+static int memlz_decoder_feed(memlz_decoder* decoder, const void* fragment, size_t len, size_t* consumed);
+
+/// Returns the number of bytes at the start of the destination that are decompressed so far
+static size_t memlz_decoder_ready(const memlz_decoder* decoder);
+
 /// Takes compressed data as input and returns the decompressed len. Only the first
 /// memlz_header_len() number of bytes need to present
 static size_t memlz_compressed_len(const void* src);
@@ -55,10 +152,26 @@ static size_t memlz_compressed_len(const void* src);
 /// memlz_header_len() number of bytes need to present
 static size_t memlz_decompressed_len(const void* src);
 
-/// Return the largest number of bytes that a given input can compress into. Note that certain
-/// kinds of data may grow beyond its original size.
+/// Return a safe upper bound of the number of bytes that a given input can compress into. It
+/// assumes that every round of 16 words takes up 3 bytes more than the input it encodes, so
+/// data can grow by 3 bytes for each 64 bytes of input, plus at most 39 bytes for the header,
+/// options and the last block. Actual output stays below that, because rounds without any hits
+/// are soon followed by uncompressed blocks, and random data leaves about 4% of it unused.
 static size_t memlz_max_compressed_len(size_t input);
 
+/// Like memlz_compress() but never writes more than capacity bytes to destination. Compression
+/// stops as soon as the output would not fit, or when it is larger than its share of capacity
+/// for the input so far, which happens after a few KB of input that does not compress. The data
+/// is then stored uncompressed instead, which takes memlz_stored_len(len) bytes, so a capacity
+/// of that size gives either compressed data that is no larger or stored data. The output can
+/// be decompressed by memlz_decompress().
+///
+/// Returns 0 if the stored data does not fit either or if internal memory allocation failed
+static size_t memlz_compress_bounded(void* destination, size_t capacity, const void* source, size_t len);
+
+/// Returns the number of bytes that memlz_compress_bounded() needs to store a given input
+static size_t memlz_stored_len(size_t input);
+
 /// Returns the number of bytes of compressed data that need to be present in order to call 
 /// memlz_compressed_len() and memlz_decompressed_len()
 static size_t memlz_header_len();
@@ -66,6 +179,284 @@ static size_t memlz_header_len();
 ///  Call this before the first call to memlz_compress() or memlz_decompress()
 static void memlz_reset(memlz_state* c);
 
+/// Returns the number of bytes of a memlz_state, for callers that allocate it themselves
+static size_t memlz_state_size();
+
+/// Like memlz_reset() but gives the hash tables 2^table_bits entries, where table_bits
+/// is from 10 to 16 and the default is 16. Smaller tables give a smaller state that can
+/// stay in the L1 or L2 cache, at the cost of compression ratio. The state then only needs
+/// to be memlz_state_size_bits(table_bits) bytes large.
+///
+/// The table size is recorded in each packet. A decoder must use a state that was reset
+/// with the same table_bits, except memlz_decompress() which adapts by itself.
+static void memlz_reset_bits(memlz_state* c, int table_bits);
+
+/// Returns the number of bytes of a memlz_state that is reset with memlz_reset_bits()
+static size_t memlz_state_size_bits(int table_bits);
+
+/// Like memlz_compress() but uses a state owned by the caller and never allocates memory.
+/// Call memlz_reset(state) once before the first call. Each call leaves the state reset
+/// again by only clearing the table entries that the input could have touched, so the cost
+/// of reusing the state is proportional to len instead of the size of the state.
+static size_t memlz_compress_with_state(void* destination, const void* source, size_t len, memlz_state* state);
+
+/// Like memlz_decompress() but uses a state owned by the caller and never allocates memory.
+/// Call memlz_reset(state) once before the first call. The state is left reset like with
+/// memlz_compress_with_state().
+///
+/// Returns 0 if compressed data was malformed
+static size_t memlz_decompress_with_state(void* destination, const void* source, memlz_state* state);
+
+/// Make the packets that a state compresses carry a 64-bit checksum of their decompressed data,
+/// which decompression verifies. It is computed in the same pass as the compression, while
+/// the data is in the cache. Call it after memlz_reset().
+static void memlz_set_checksum(memlz_state* state, int enable);
+
+/// Returns the checksum of compressed data, or 0 if it has none. Only the first
+/// memlz_compressed_len(source) bytes are read.
+static uint64_t memlz_compressed_checksum(const void* source);
+
+#define MEMLZ_FILTER_NONE 0
+#define MEMLZ_FILTER_DELTA 1
+#define MEMLZ_FILTER_XOR 2
+#define MEMLZ_FILTER_SHUFFLE 4
+
+/// Make a state filter the data of its packets before it compresses them, for arrays of records
+/// of stride bytes, where stride is from 1 to 255. Neighbouring numbers rarely repeat exactly,
+/// so words of such data seldom match, but their bytes often do. MEMLZ_FILTER_DELTA subtracts
+/// each byte of the previous record from the same byte of a record, and MEMLZ_FILTER_XOR xors
+/// them instead, which turns counters and timestamps that change slowly into mostly zero bytes.
+/// MEMLZ_FILTER_SHUFFLE, which can be combined with either, groups byte 0 of all records, then
+/// byte 1 and so on, within blocks of about 1 KB. The filter is recorded in the packets and
+/// decompression reverses it. Call it after memlz_reset().
+///
+/// Returns 0 if filter or stride is invalid
+static int memlz_set_filter(memlz_state* state, int filter, size_t stride);
+
+/// Make a state look for 4 KB pages of a packet that are equal to an earlier page of the same
+/// packet and encode them as a reference to it, like duplicate blocks of a disk image or a
+/// backup. The hash tables only find words that were seen recently, so such pages would
+/// otherwise be encoded again word by word. Pages are aligned to the start of the packet, and
+/// a compact index of them is allocated during each call for packets of at least 8 KB, so it
+/// pays off for large packets. Decompression needs no setting. It has no effect together with
+/// a filter or with memlz_stream_compressv(). Call it after memlz_reset().
+static void memlz_set_long_range(memlz_state* state, int enable);
+
+/// Build a dictionary from samples of typical messages, for compressing small independent
+/// messages with memlz_compress_with_state() and a state that the dictionary is loaded into.
+/// The dictionary holds the hash tables of a state with 2^table_bits entries, which are filled
+/// with the most frequent words of the samples, so it is memlz_dictionary_len(table_bits)
+/// bytes. Smaller tables give dictionaries that are faster to load.
+///
+/// Returns the length of the dictionary, or 0 if capacity is too small or if internal memory
+/// allocation failed
+static size_t memlz_train_dictionary(void* dictionary, size_t capacity, const void* const* samples, const size_t* sample_lens, size_t count, int table_bits);
+
+/// Returns the number of bytes of a dictionary with the given table size
+static size_t memlz_dictionary_len(int table_bits);
+
+/// Reset a state and load the tables from a dictionary, which is a copy of the data. The state
+/// must be at least memlz_state_size_bits() large for the table size of the dictionary. The
+/// dictionary must stay valid while the state is used, because memlz_compress_with_state()
+/// and memlz_decompress_with_state() restore the table entries that they touch from it.
+/// Packets record the dictionary ID and can only be decompressed by a state with the same
+/// dictionary loaded.
+///
+/// Returns 0 if the dictionary is malformed
+static int memlz_state_load_dictionary(memlz_state* state, const void* dictionary, size_t len);
+
+/// Returns the ID of a dictionary, which is never 0
+static uint32_t memlz_dictionary_id(const void* dictionary);
+
+/// Save a state to a checkpoint, so that a stream can be resumed after a restart by loading it
+/// with memlz_state_load(). It holds the settings, the fields that choose the word length and
+/// the table entries that differ from those of a reset state, so it is small for a state that
+/// has compressed little data. It works for states that compress and for states that
+/// decompress.
+///
+/// Returns the length of the checkpoint, or 0 if capacity is smaller than
+/// memlz_state_save_len() for the table size of the state
+static size_t memlz_state_save(const memlz_state* state, void* destination, size_t capacity);
+
+/// Returns the largest number of bytes that memlz_state_save() writes for a table size
+static size_t memlz_state_save_len(int table_bits);
+
+/// Load a checkpoint from memlz_state_save() into a state, which must be memlz_state_size_bits()
+/// large for the table size of the checkpoint. If the saved state had a dictionary, load the
+/// same dictionary into the state with memlz_state_load_dictionary() first.
+///
+/// Returns 0 if the checkpoint is malformed, is from another version of the format or needs a
+/// dictionary that is not loaded
+static int memlz_state_load(memlz_state* state, const void* source, size_t len);
+
+/// Copy a state, for example to fork a state that has compressed some data into several streams
+/// that continue from it. Only the tables of the table size of source are copied, so destination
+/// needs to be memlz_state_size_bits() large for that size. A dictionary is shared.
+static void memlz_state_clone(memlz_state* destination, const memlz_state* source);
+
+/// Returns the ID of the dictionary that compressed data needs, or 0 if it needs none or is
+/// malformed. Only the first memlz_compressed_len(source) bytes are read.
+static uint32_t memlz_compressed_dictionary_id(const void* source);
+
+/// Settings of memlz_compress_batch() and memlz_decompress_batch(). A null pointer to them
+/// gives the settings of memlz_compress().
+typedef struct memlz_batch_options {
+    int table_bits;         // From 10 to 16, or 0 for 16. The dictionary decides if there is one
+    const void* dictionary; // Dictionary from memlz_train_dictionary(), or 0
+    size_t dictionary_len;
+    int checksum;           // See memlz_set_checksum()
+    int filter;             // See memlz_set_filter()
+    size_t stride;
+} memlz_batch_options;
+
+/// Compress count independent messages, like memlz_compress() does for each of them, but with
+/// a single state that is allocated and reset once and restored between the messages like with
+/// memlz_compress_with_state(). Destination i must be at least memlz_max_compressed_len(lens[i])
+/// large, and its compressed length is stored in compressed_lens[i]. Without a dictionary each
+/// message can be decompressed by memlz_decompress(), and with one by memlz_decompress_batch()
+/// or memlz_decompress_with_state() and a state that has the dictionary loaded.
+///
+/// Returns the total compressed length, or 0 if the options are invalid or if internal memory
+/// allocation failed
+static size_t memlz_compress_batch(void* const* destinations, const void* const* sources, const size_t* lens, size_t count, size_t* compressed_lens, const memlz_batch_options* options);
+
+/// Decompress count independent messages with a single state. Destination i must be at least
+/// memlz_decompressed_len(sources[i]) large, and its decompressed length is stored in
+/// decompressed_lens[i], which is 0 if the message is malformed. Only the dictionary of the
+/// options is used, because the rest is recorded in the messages.
+///
+/// Returns the number of messages that were decompressed, which is less than count if some
+/// were malformed, or 0 if internal memory allocation failed
+static size_t memlz_decompress_batch(void* const* destinations, const void* const* sources, size_t count, size_t* decompressed_lens, const memlz_batch_options* options);
+
+#ifdef MEMLZ_POOL
+typedef struct memlz_pool memlz_pool;
+
+#define MEMLZ_POOL_HUGE_PAGES 1
+
+/// Create a pool of states with 2^table_bits entries, from 10 to 16, for servers with many
+/// streams. It is only available if MEMLZ_POOL is defined before including this header. The
+/// states are page aligned and are carved from large mappings, which are huge pages with
+/// MEMLZ_POOL_HUGE_PAGES if the system grants them. The pool can be used from several threads.
+///
+/// Returns 0 if internal memory allocation failed
+static memlz_pool* memlz_pool_create(int table_bits, int flags);
+
+/// Free a pool together with all of its states
+static void memlz_pool_destroy(memlz_pool* pool);
+
+/// Get a state that is reset like by memlz_reset_bits() with the table size of the pool. The
+/// tables of a new or recycled state are not cleared before they are used, and the memory of
+/// a recycled state was given back to the system, so a stream only takes memory for the pages
+/// of the tables that it touches. memlz_reset() and memlz_reset_bits() keep the table size of
+/// the pool if they are asked for larger tables, and memlz_state_load() and
+/// memlz_state_load_dictionary() refuse larger tables. Do not clone a state with larger tables
+/// into it.
+///
+/// Returns 0 if internal memory allocation failed
+static memlz_state* memlz_pool_acquire(memlz_pool* pool);
+
+/// Give a state back to the pool, which gives the memory of its tables back to the system
+static void memlz_pool_release(memlz_pool* pool, memlz_state* state);
+
+/// Give the memory of the tables of an idle stream back to the system, but keep the settings
+/// and the position of the stream, which take less than a page. The stream then continues with
+/// reset tables. The next packet of a compressing state tells the decompressor to reset its
+/// tables too, so only the compressing side needs to know that the stream was idle. A
+/// decompressing state that was idle can only continue with such a packet, so let it be idle
+/// only when the compressing state was too. With huge pages the memory cannot be given back in
+/// part, and the tables are then just cleared when they are used again.
+static void memlz_pool_idle(memlz_pool* pool, memlz_state* state);
+#endif
+
+#ifdef MEMLZ_STATS
+/// Statistics of the compression of a stream, which are only collected if MEMLZ_STATS is
+/// defined before including this header. The phase timers are only collected if
+/// MEMLZ_STATS_CYCLES is defined too, and count CPU timestamp ticks on x86 and ARM64.
+typedef struct memlz_stats {
+    uint64_t rle_blocks;          // Runs of equal 8-byte words
+    uint64_t uncompressed_blocks; // Data that was stored because nothing matched
+    uint64_t normal64_blocks;     // Rounds of 16 8-byte words
+    uint64_t normal32_blocks;     // Rounds of 16 4-byte words
+    uint64_t rle_bytes;           // Input bytes of each block type, where the normal blocks
+    uint64_t uncompressed_bytes;  // include the bytes after the last round
+    uint64_t normal64_bytes;
+    uint64_t normal32_bytes;
+    uint64_t hits;                // Words of normal blocks that were found in the hash table
+    uint64_t misses;
+    uint64_t wordlen_switches;    // Times that probing switched between 8 and 4-byte words
+    uint64_t page_blocks;         // References to earlier pages, see memlz_set_long_range()
+    uint64_t page_bytes;
+    uint64_t rle_cycles;          // Time spent in each phase
+    uint64_t normal_cycles;
+    uint64_t uncompressed_cycles;
+} memlz_stats;
+
+/// Returns the statistics of the streams that a state has compressed since it was reset with
+/// memlz_reset(), memlz_reset_bits() or memlz_reset_stats(). The state resets of
+/// memlz_compress_with_state() keep them.
+static const memlz_stats* memlz_get_stats(const memlz_state* state);
+
+static void memlz_reset_stats(memlz_state* state);
+#endif
+
+/// Compress non-streaming data into a frame of independent blocks that are compressed
+/// in parallel by up to the given number of threads. The destination buffer must be at
+/// least memlz_max_compressed_len_mt(len) large. Threads are only used if MEMLZ_THREADS
+/// is defined before including this header, else the blocks are compressed one by one.
+///
+/// Returns 0 if internal memory allocation failed
+static size_t memlz_compress_mt(void* destination, const void* source, size_t len, size_t threads);
+
+/// Decompress a frame made by memlz_compress_mt() using up to the given number of
+/// threads. The destination buffer must be at least memlz_decompressed_len(source) large.
+/// A frame can also be decompressed by memlz_decompress().
+///
+/// Returns 0 if compressed data was malformed or if internal memory allocation failed.
+static size_t memlz_decompress_mt(void* destination, const void* source, size_t threads);
+
+/// Return the largest number of bytes that memlz_compress_mt() can compress a given input into
+static size_t memlz_max_compressed_len_mt(size_t input);
+
+/// Compress non-streaming data into a seekable frame where the tables are reset at every
+/// block_len bytes of input. A smaller block_len gives faster random access at the cost of
+/// compression ratio. Frames made by memlz_compress_mt() are seekable too, with 4 MB blocks.
+/// The destination buffer must be at least memlz_max_compressed_len_seekable(len, block_len) large.
+///
+/// Returns 0 if block_len is 0 or if internal memory allocation failed
+static size_t memlz_compress_seekable(void* destination, const void* source, size_t len, size_t block_len);
+
+/// Decompress len bytes that start at the given offset in the decompressed data of a seekable
+/// frame. Only the blocks that cover the range are decompressed. The destination buffer must
+/// be at least len large.
+///
+/// Returns 0 if compressed data was malformed, if the range is outside the decompressed data
+/// or if internal memory allocation failed. 
+static size_t memlz_decompress_range(const void* source, size_t offset, size_t len, void* destination);
+
+/// Return the largest number of bytes that memlz_compress_seekable() can compress a given input into
+static size_t memlz_max_compressed_len_seekable(size_t input, size_t block_len);
+
+#define MEMLZ_KERNEL_AUTO 0
+#define MEMLZ_KERNEL_SCALAR 1
+#define MEMLZ_KERNEL_SSE42 2
+#define MEMLZ_KERNEL_AVX2 3
+#define MEMLZ_KERNEL_AVX512 4
+#define MEMLZ_KERNEL_NEON 5
+
+/// The SIMD kernels of the hot loops are compiled for all instruction sets that the compiler
+/// supports, and the best one that the CPU supports is selected at the first call, except that
+/// the AVX2 and AVX-512 kernels are not selected automatically because they are not faster than
+/// the scalar code on all data. This overrides the selection with one of the MEMLZ_KERNEL_
+/// values, for example to enable them or for A/B testing.
+/// All kernels produce the same compressed data. Call it before other threads use memlz,
+/// and note that it only affects the source file that calls it. Define MEMLZ_NO_SIMD to
+/// only compile the scalar kernel.
+///
+/// Returns the kernel that is used, which is MEMLZ_KERNEL_SCALAR if the requested one is
+/// not supported
+static int memlz_select_kernel(int kernel);
+
 // The rest of this header file is internals
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -73,10 +464,19 @@ static void memlz_reset(memlz_state* c);
 #define MEMLZ__DO_INCOMPRESSIBLE
 #define MEMLZ__INCOMPRESSIBLE_TRIGGER (4)
 #define MEMLZ__INCOMPRESSIBLE_ADVANCE (16 * MEMLZ__INCOMPRESSIBLE_TRIGGER)
+#define MEMLZ__INCOMPRESSIBLE_STREAK (1024 / MEMLZ__INCOMPRESSIBLE_ADVANCE)
 #define MEMLZ__PROBELEN (2 * 1024)
 #define MEMLZ__BLOCKLEN (128 * 1024)
 #define MEMLZ__RLE 'D'
 #define MEMLZ__MIN_RLE (4 * sizeof(uint64_t))
+#define MEMLZ__LOOKAHEAD (16 * sizeof(uint64_t) + 1024)
+#define MEMLZ__GATHER (4 * 1024)
+#define MEMLZ__BAIL_TOLERANCE 64
+#define MEMLZ__SCRUB_LIMIT (32 * 1024)
+#define MEMLZ__SCRUB_RATIO 32
+#define MEMLZ__SIMD_BACKOFF 64
+#define MEMLZ__SIMD_HITS 14
+#define MEMLZ__SIMD_HITS_BACKOFF 16
 
 #define MEMLZ__RESTRICT __restrict
 
@@ -85,9 +485,56 @@ static void memlz_reset(memlz_state* c);
 #define MEMLZ__NORMAL32 'A'
 #define MEMLZ__NORMAL64 'B'
 #define MEMLZ__UNCOMPRESSED 'C'
+#define MEMLZ__OPTIONS 'E'
+#define MEMLZ__FRAME 'F'
+#define MEMLZ__PAGES 'G'
+#define MEMLZ__PAGE (4 * 1024)
+#define MEMLZ__PAGE_BITS 12
+#define MEMLZ__PAGE_SAMPLES 8
+#define MEMLZ__OPT_BITS 1
+#define MEMLZ__OPT_DICT 2
+#define MEMLZ__OPT_CHECKSUM 4
+#define MEMLZ__OPT_FILTER 8
+#define MEMLZ__OPT_RESET 16
+#define MEMLZ__COLD_ZERO 1
+#define MEMLZ__COLD_DIRTY 2
+#define MEMLZ__POOL_CHUNK (8 * 1024 * 1024)
+#define MEMLZ__POOL_TAG 0x6c6f6f707a6c6dull
+#define MEMLZ__HUGE_PAGE (2 * 1024 * 1024)
+#define MEMLZ__MAX_STRIDE 255
+#define MEMLZ__MAX_FILTER_BLOCK (8 * MEMLZ__MAX_STRIDE)
+#define MEMLZ__MAX_BLOCK_INPUT (1 + 2 + 16 * sizeof(uint64_t))
+#define MEMLZ__DICT_HEADER 16
+#define MEMLZ__SAVE_FIELDS 8
+#define MEMLZ__SAVE_HEADER (16 + MEMLZ__SAVE_FIELDS * 8)
+#define MEMLZ__SAVE_VERSION 1
+#define MEMLZ__MIN_BITS 10
+#define MEMLZ__MAX_BITS 16
+#define MEMLZ__FRAME_BLOCKLEN (4 * 1024 * 1024)
 
 #define MEMLZ__MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 
+#define MEMLZ__SUM_CHUNK 1024
+#define MEMLZ__P1 11400714785074694791ull
+#define MEMLZ__P2 14029467366897019727ull
+#define MEMLZ__P3 1609587929392839161ull
+#define MEMLZ__P4 9650029242287828579ull
+#define MEMLZ__ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#ifdef MEMLZ_STATS
+#define MEMLZ__STAT(op) op
+#else
+#define MEMLZ__STAT(op)
+#endif
+
+#ifdef MEMLZ_STATS_CYCLES
+#define MEMLZ__TIMER(t) const uint64_t t = memlz__cycles()
+#define MEMLZ__TIMER_ADD(field, t) state->stats.field += memlz__cycles() - (t)
+#else
+#define MEMLZ__TIMER(t)
+#define MEMLZ__TIMER_ADD(field, t)
+#endif
+
 #ifdef _WIN32
 #define MEMLZ__UNUSED
 #else
@@ -97,12 +544,24 @@ static void memlz_reset(memlz_state* c);
 static const size_t memlz__fields = 2;
 static const size_t memlz__words_per_round = 16;
 
-static uint16_t memlz__hash32(uint32_t v) {
-    return (uint16_t)(((v * 2654435761ull) >> 16));
+// Block types and limits that memlz.hpp also encodes with. The macros are undefined at the end
+// of this file
+MEMLZ__UNUSED static const uint8_t memlz__block_normal32 = MEMLZ__NORMAL32;
+MEMLZ__UNUSED static const uint8_t memlz__block_normal64 = MEMLZ__NORMAL64;
+MEMLZ__UNUSED static const uint8_t memlz__block_uncompressed = MEMLZ__UNCOMPRESSED;
+MEMLZ__UNUSED static const uint8_t memlz__block_rle = MEMLZ__RLE;
+MEMLZ__UNUSED static const uint8_t memlz__block_options = MEMLZ__OPTIONS;
+MEMLZ__UNUSED static const uint8_t memlz__opt_bits = MEMLZ__OPT_BITS;
+MEMLZ__UNUSED static const size_t memlz__max_bits = MEMLZ__MAX_BITS;
+MEMLZ__UNUSED static const size_t memlz__min_rle = MEMLZ__MIN_RLE;
+
+// The top bits of a 32-bit product, which compilers turn into a single 32-bit multiply
+static uint16_t memlz__hash32(uint32_t v, size_t bits) {
+    return (uint16_t)((uint32_t)(v * 2654435761u) >> (32 - bits));
 }
 
-static uint16_t memlz__hash64(uint64_t v) {
-    return (uint16_t)(((v * 11400714819323198485ull) >> 48));
+static uint16_t memlz__hash64(uint64_t v, size_t bits) {
+    return (uint16_t)(((v * 11400714819323198485ull) >> (64 - bits)));
 }
 
 
@@ -149,13 +608,34 @@ static void memlz__write(void* dst, uint64_t value, size_t bytes) {
     }
 }
 
+// Number of set bits in a 16-bit value
+MEMLZ__UNUSED static unsigned memlz__popcount16(unsigned m) {
+    m = m - ((m >> 1) & 0x5555);
+    m = (m & 0x3333) + ((m >> 2) & 0x3333);
+    m = (m + (m >> 4)) & 0x0f0f;
+    return (m + (m >> 8)) & 0x1f;
+}
+
+#ifdef MEMLZ_STATS_CYCLES
+static uint64_t memlz__cycles(void) {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return 0;
+#endif
+}
+#endif
+
 static uint64_t memlz__fit(uint64_t value) {
     return value < 64ULL ? 1ULL : value <= 0xffffULL ? 3ULL : value <= 0xffffffffULL ? 5ULL : 9ULL;
 }
 
+// The tables must be last so that a state with smaller tables can be allocated with fewer bytes
 typedef struct memlz_state {
-    uint64_t hash64[1 << 16];
-    uint32_t hash32[1 << 16];
     uint64_t total_input;
     uint64_t total_output;
     size_t mod;
@@ -163,20 +643,193 @@ typedef struct memlz_state {
     size_t cs4;
     size_t cs8;
     size_t incompressible;
+    size_t backoff;
+    size_t bits;
+    const uint8_t* dict;
+    uint32_t dict_id;
+    char checksum;
+    uint8_t filter;
+    uint8_t stride;
+    char long_range;
+    // MEMLZ__COLD_ZERO if the tables were given back to the system and are zero, or
+    // MEMLZ__COLD_DIRTY if they must be reset before they are used, see memlz_pool_idle()
+    char cold;
+#ifdef MEMLZ_POOL
+    // A state of a pool has room for tables of pool_bits, and pool_tag is its address mixed
+    // with MEMLZ__POOL_TAG, see memlz__room()
+    uint64_t pool_tag;
+    size_t pool_bits;
+#endif
+#ifdef MEMLZ_STATS
+    memlz_stats stats;
+#endif
     char reset;
+    uint64_t tables[(1 << MEMLZ__MAX_BITS) + (1 << MEMLZ__MAX_BITS) / 2];
 } memlz_state;
 
+// The hash64 table of 2^bits entries followed by the hash32 table of 2^bits entries
+static uint64_t* memlz__hash64_table(memlz_state* c) {
+    return c->tables;
+}
+
+static uint32_t* memlz__hash32_table(memlz_state* c) {
+    return (uint32_t*)(c->tables + ((size_t)1 << c->bits));
+}
+
+static size_t memlz__bits(int table_bits) {
+    return table_bits < MEMLZ__MIN_BITS ? MEMLZ__MIN_BITS : table_bits > MEMLZ__MAX_BITS ? MEMLZ__MAX_BITS : (size_t)table_bits;
+}
+
+typedef struct memlz__options {
+    unsigned flags;
+    size_t bits;
+    uint32_t dict_id;
+    unsigned filter;
+    size_t stride;
+    uint64_t checksum;
+} memlz__options;
+
+// State of the checksum, see memlz__sum_update()
+typedef struct memlz__sum {
+    uint64_t lanes[8];
+    uint64_t words;
+} memlz__sum;
+
+// The units of a packet are the header, the options and each block. The decoder decodes a
+// unit directly from a fragment if it is complete there, or else collects it in buf first.
+// Only uncompressed blocks can be larger than buf, so their data is copied as it arrives.
+typedef struct memlz_decoder {
+    memlz_state* state;
+    uint8_t* dst;
+    size_t capacity;
+    size_t compressed_len;
+    size_t decompressed_len;
+    size_t pos;      // Bytes of the packet consumed, including those in buf
+    size_t written;
+    size_t missing;
+    size_t copy;     // Bytes of an uncompressed block that are not copied yet
+    size_t summed;
+    size_t unfiltered;
+    size_t buffered;
+    int phase;
+    int status;
+    memlz__options options;
+    memlz__sum sum;
+    uint8_t buf[3 + 16 * sizeof(uint64_t)];
+} memlz_decoder;
+
+static int memlz__valid_filter(int filter, size_t stride) {
+    return filter > 0 && filter <= (MEMLZ_FILTER_XOR | MEMLZ_FILTER_SHUFFLE) && (filter & 3) != 3 && stride >= 1 && stride <= MEMLZ__MAX_STRIDE;
+}
+
+// A stream that continues after its tables were given back while it was idle must tell the
+// decompressor to reset its tables. That is not needed before the first packet
+static int memlz__restart(const memlz_state* c) {
+    return c->cold && (c->total_input || c->total_output);
+}
+
+// Packets of states with non-default settings begin with a MEMLZ__OPTIONS block that holds a
+// byte of MEMLZ__OPT_ flags followed by a field for each flag that is set, except for
+// MEMLZ__OPT_RESET, which has none. The checksum is the last field, so that the compressor can
+// fill it in when it is done.
+static uint8_t* memlz__write_options(uint8_t* dst, const memlz_state* c) {
+    const int restart = memlz__restart(c);
+    if (c->bits == MEMLZ__MAX_BITS && c->dict_id == 0 && !c->checksum && !c->filter && !restart) {
+        return dst;
+    }
+    uint8_t* flags = dst + 1;
+    *dst++ = MEMLZ__OPTIONS;
+    *dst++ = restart ? MEMLZ__OPT_RESET : 0;
+    if (c->bits != MEMLZ__MAX_BITS) {
+        *flags |= MEMLZ__OPT_BITS;
+        *dst++ = (uint8_t)c->bits;
+    }
+    if (c->dict_id != 0) {
+        *flags |= MEMLZ__OPT_DICT;
+        *(uint32_t*)dst = c->dict_id;
+        dst += sizeof(uint32_t);
+    }
+    if (c->filter) {
+        *flags |= MEMLZ__OPT_FILTER;
+        *dst++ = c->filter;
+        *dst++ = c->stride;
+    }
+    if (c->checksum) {
+        *flags |= MEMLZ__OPT_CHECKSUM;
+        dst += sizeof(uint64_t);
+    }
+    return dst;
+}
+
+// Returns a pointer past the options of a packet, or 0 if they are malformed
+static const uint8_t* memlz__read_options(const uint8_t* src, const uint8_t* end, memlz__options* o) {
+    o->flags = 0;
+    o->bits = MEMLZ__MAX_BITS;
+    o->dict_id = 0;
+    o->filter = MEMLZ_FILTER_NONE;
+    o->stride = 0;
+    o->checksum = 0;
+    if (src >= end || *src != MEMLZ__OPTIONS) {
+        return src;
+    }
+    if (end - src < 2 || (src[1] & ~(MEMLZ__OPT_BITS | MEMLZ__OPT_DICT | MEMLZ__OPT_FILTER | MEMLZ__OPT_CHECKSUM | MEMLZ__OPT_RESET))) {
+        return 0;
+    }
+    o->flags = src[1];
+    src += 2;
+
+    if (o->flags & MEMLZ__OPT_BITS) {
+        if (src >= end || *src < MEMLZ__MIN_BITS || *src > MEMLZ__MAX_BITS) {
+            return 0;
+        }
+        o->bits = *src++;
+    }
+    if (o->flags & MEMLZ__OPT_DICT) {
+        if (end - src < (ptrdiff_t)sizeof(uint32_t) || *(const uint32_t*)src == 0) {
+            return 0;
+        }
+        o->dict_id = *(const uint32_t*)src;
+        src += sizeof(uint32_t);
+    }
+    if (o->flags & MEMLZ__OPT_FILTER) {
+        if (end - src < 2 || !memlz__valid_filter(src[0], src[1])) {
+            return 0;
+        }
+        o->filter = src[0];
+        o->stride = src[1];
+        src += 2;
+    }
+    if (o->flags & MEMLZ__OPT_CHECKSUM) {
+        if (end - src < (ptrdiff_t)sizeof(uint64_t)) {
+            return 0;
+        }
+        o->checksum = *(const uint64_t*)src;
+        src += sizeof(uint64_t);
+    }
+    return src;
+}
+
+// Rounds of 4-byte words add the most, which is a block byte and 2 bytes of flags for each 64
+// bytes. An uncompressed block adds 4 bytes, but it follows at least 4 rounds and is at least 256
+// bytes long except at the end of the input, where it can be 64 bytes and add 1 more than rounds
+// would. Runs always shrink. The last block adds 3 bytes, options add 17 and the header 18.
 static size_t memlz_max_compressed_len(size_t input) {
-    return 68 * input / 64 + 100; // todo, find real bound
+    return input + input / 64 * 3 + input % 64 * 3 / 64 + 1 + 3 + 17 + 18;
 }
 
 static size_t memlz_header_len() {
     return 18;
 }
 
-static void memlz_reset(memlz_state* c) {
-    memset(c->hash32, 0, sizeof(c->hash32));
-    memset(c->hash64, 0, sizeof(c->hash64));
+// Stored data is the header, an uncompressed block of all whole words and a last block that
+// holds the remaining bytes
+static size_t memlz_stored_len(size_t input) {
+    const size_t words = input & ~(sizeof(uint64_t) - 1);
+    const size_t len = memlz__fields * memlz__fit(memlz_max_compressed_len(input)) + 1 + memlz__fit(words) + 1 + input;
+    return len < memlz_header_len() ? memlz_header_len() : len;
+}
+
+static void memlz__reset_fields(memlz_state* c) {
     c->total_input = 0;
     c->total_output = 0;
     c->mod = 0;
@@ -184,405 +837,3326 @@ static void memlz_reset(memlz_state* c) {
     c->cs4 = 0;
     c->cs8 = 0;
     c->incompressible = 0;
+    c->backoff = 0;
     c->reset = 'Y';
 }
 
-static size_t memlz_stream_compress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, memlz_state* state) {
-    if (state->reset != 'Y') {
-        return 0;
+// Bring the tables back to their reset condition, which is the image of the dictionary if one is loaded
+static void memlz__reset_tables(memlz_state* c) {
+    if (c->dict) {
+        memcpy(c->tables, c->dict + MEMLZ__DICT_HEADER, (sizeof(uint64_t) + sizeof(uint32_t)) << c->bits);
     }
+    else {
+        memset(c->tables, 0, (sizeof(uint64_t) + sizeof(uint32_t)) << c->bits);
+    }
+}
 
-    const size_t max = memlz_max_compressed_len(len) > len ? memlz_max_compressed_len(len) : len;
-    const size_t header_len = memlz__fields * memlz__fit(max);
-    size_t missing = len;
-    const uint8_t* src = (const uint8_t*)source;
-    uint8_t* dst = (uint8_t*)destination;
-    uint16_t flags = 0;
-    dst += header_len;
-
-    for(;;) {
-            // Compress 8-byte words, then 4-byte words and compare ratios and select best.
-            // TODO: Occurences of RLE or incompressible blocks wil disturb the result.
-            state->mod++;
-            if (state->mod == MEMLZ__PROBELEN / 128) {
-                state->cs8 = (state->total_output + (dst - (uint8_t*)destination)) - state->cs8;
-                state->cs4 = (state->total_output + (dst - (uint8_t*)destination));
-                state->wordlen = 4;
-            }
-            else if (state->mod == 3 * MEMLZ__PROBELEN / 128) {
-                state->cs4 = state->total_output + (dst - (uint8_t*)destination) - state->cs4;
-                if (state->cs8 < state->cs4) {
-                    state->wordlen = 8;
-                }
-            }
-            else if (state->mod == (MEMLZ__BLOCKLEN + MEMLZ__PROBELEN) / 128) {
-                state->wordlen = 8;
-                state->mod = 0;
-                state->cs8 = state->total_output + (dst - (uint8_t*)destination);
-                state->cs4 = 0;
-            }
+// The settings of a reset state
+static void memlz__reset_settings(memlz_state* c, int table_bits) {
+    c->bits = memlz__bits(table_bits);
+    c->dict = 0;
+    c->dict_id = 0;
+    c->checksum = 0;
+    c->filter = MEMLZ_FILTER_NONE;
+    c->stride = 0;
+    c->long_range = 0;
+    c->cold = 0;
+    MEMLZ__STAT(memset(&c->stats, 0, sizeof(c->stats)));
+}
 
-#ifdef MEMLZ__DO_RLE
-        {
-            size_t e = 1;
-            while (e < missing / sizeof(uint64_t) && ((uint64_t*)src)[e] == *(uint64_t*)src) {
-                e++;
-            }
-            e *= sizeof(uint64_t);
-            if (e >= MEMLZ__MIN_RLE) {
-                *dst++ = MEMLZ__RLE;
-                size_t length = memlz__fit(e);
-                memlz__write(dst, e, length);
-                *(uint64_t*)(dst + length) = *(uint64_t*)src;
-                dst += sizeof(uint64_t) + length;
-                missing -= e;
-                src += e;
-                continue;
-            }
-        }
+// Returns the largest table bits up to table_bits that a state has room for. A state of a pool
+// is allocated for the table size of the pool only. Other states are not initialized before
+// they are reset, but their pool_tag would only match by an extreme coincidence
+static int memlz__room(const memlz_state* c, int table_bits) {
+#ifdef MEMLZ_POOL
+    if (c->pool_tag == ((uint64_t)(uintptr_t)c ^ MEMLZ__POOL_TAG) && memlz__bits(table_bits) > c->pool_bits) {
+        return (int)c->pool_bits;
+    }
+#else
+    (void)c;
 #endif
-        {
-            *dst++ = state->wordlen == 8 ? MEMLZ__NORMAL64 : MEMLZ__NORMAL32;
-            if (missing < 16 * state->wordlen) {
-                break;
-            }
+    return table_bits;
+}
 
-            uint16_t* flags_ptr = (uint16_t*)dst;
-            dst += 2;
+static void memlz_reset_bits(memlz_state* c, int table_bits) {
+    memlz__reset_settings(c, memlz__room(c, table_bits));
+    memlz__reset_tables(c);
+    memlz__reset_fields(c);
+}
 
-            #define MEMLZ__ENCODE_WORD(tbl, typ, h, i, next) \
-            flags <<= 1; \
-            if (tbl[h] == ((typ*)src)[i]) { \
-                flags |= 1; \
-                *(uint16_t*)dst = (uint16_t)h; \
-                dst += 2; \
-                next; \
-            } else { \
-                tbl[h] = ((typ*)src)[i]; \
-                *(typ*)dst = ((typ*)src)[i]; \
-                dst += sizeof(typ); \
-                next; \
-            }
-
-            #define MEMLZ__ENCODE4(tbl, typ, a, b, c, d) MEMLZ__ENCODE_WORD \
-                    (tbl, typ, a, 0, MEMLZ__ENCODE_WORD \
-                    (tbl, typ, b, 1, MEMLZ__ENCODE_WORD \
-                    (tbl, typ, c, 2, MEMLZ__ENCODE_WORD \
-                    (tbl, typ, d, 3, ))))
+static void memlz_reset(memlz_state* c) {
+    memlz_reset_bits(c, MEMLZ__MAX_BITS);
+}
 
-            if (state->wordlen == 8) {
-                uint64_t a, b, c, d;
-                MEMLZ__UNROLL4(\
-                    a = memlz__hash64(((uint64_t*)src)[0]); \
-                    b = memlz__hash64(((uint64_t*)src)[1]); \
-                    c = memlz__hash64(((uint64_t*)src)[2]); \
-                    d = memlz__hash64(((uint64_t*)src)[3]); \
-                    MEMLZ__ENCODE4(state->hash64, uint64_t, a, b, c, d); \
-                    src += 4 * sizeof(uint64_t);
-                )
-            }
-            else {
-                uint32_t a, b, c, d;
-                MEMLZ__UNROLL4(\
-                    a = memlz__hash32(((uint32_t*)src)[0]); \
-                    b = memlz__hash32(((uint32_t*)src)[1]); \
-                    c = memlz__hash32(((uint32_t*)src)[2]); \
-                    d = memlz__hash32(((uint32_t*)src)[3]); \
-                    MEMLZ__ENCODE4(state->hash32, uint32_t, a, b, c, d); \
-                    src += 4 * sizeof(uint32_t);
-                )
-            }
+// Reset the tables of a state that was idle, before it is used. Zero tables only need it for the
+// image of a dictionary
+static void memlz__warm(memlz_state* c) {
+    if (c->cold == MEMLZ__COLD_DIRTY || (c->cold && c->dict)) {
+        memlz__reset_tables(c);
+    }
+    c->cold = 0;
+}
 
-            *flags_ptr = (uint16_t)flags;
-            missing -= 16 * state->wordlen;
-        }
+// Prepare a decompressing state for a packet with the given MEMLZ__OPT_ flags. Returns 0 if the
+// state was idle in the middle of a stream and the packet was compressed with earlier tables
+static int memlz__resume(memlz_state* c, unsigned flags) {
+    if (flags & MEMLZ__OPT_RESET) {
+        c->cold = c->cold ? c->cold : MEMLZ__COLD_DIRTY;
+    }
+    else if (memlz__restart(c)) {
+        return 0;
+    }
+    memlz__warm(c);
+    return 1;
+}
 
-#ifdef MEMLZ__DO_INCOMPRESSIBLE
-        {
-            state->incompressible = flags ? 0 : state->incompressible + 1;
-            if (state->incompressible > 0 && missing >= MEMLZ__INCOMPRESSIBLE_ADVANCE && state->incompressible % MEMLZ__INCOMPRESSIBLE_TRIGGER == 0) {
-                size_t u = MEMLZ__INCOMPRESSIBLE_ADVANCE * state->incompressible;
-                u = u > missing ? missing : u;
-                u = u > 1024 ? 1024 : u;
-                u = u & ~(sizeof(uint64_t) - 1);
-                *dst++ = MEMLZ__UNCOMPRESSED;
-                *(uint16_t*)dst = (uint16_t)u;
-                memlz__write(dst, u, memlz__fit(u));
-                dst += memlz__fit(u);
-                for (size_t n = 0; n < u / sizeof(uint64_t); n++) {
-                    ((uint64_t*)dst)[n] = ((uint64_t*)src)[n];
-                }
-                dst += u;
-                src += u;
-                missing -= u;
-            }
+// Bring a state that was reset before it compressed or decompressed the given data back to the
+// reset condition. Words are always read at offsets that are multiples of 4 bytes from the start
+// of a packet, so for small packets it is cheaper to clear the entries they hash to than to
+// clear the full tables. With a dictionary the entries are restored from it instead.
+// Restore the entries of the words that begin in the first starts bytes of data, which holds
+// len bytes
+static void memlz__clear_entries(memlz_state* c, const uint8_t* d, size_t starts, size_t len) {
+    uint64_t* hash64 = memlz__hash64_table(c);
+    uint32_t* hash32 = memlz__hash32_table(c);
+    const uint64_t* dict64 = c->dict ? (const uint64_t*)(c->dict + MEMLZ__DICT_HEADER) : 0;
+    const uint32_t* dict32 = c->dict ? (const uint32_t*)(dict64 + ((size_t)1 << c->bits)) : 0;
+    for (size_t i = 0; i < starts && i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+        uint16_t h = memlz__hash32(*(const uint32_t*)(d + i), c->bits);
+        hash32[h] = dict32 ? dict32[h] : 0;
+        if (i + sizeof(uint64_t) <= len) {
+            h = memlz__hash64(*(const uint64_t*)(d + i), c->bits);
+            hash64[h] = dict64 ? dict64[h] : 0;
         }
-#endif
     }
-  
-    if (missing >= state->wordlen) {
-        uint16_t* flag_ptr = (uint16_t*)dst;
-        dst += 2;
-        flags = 0;
-        int flags_left = memlz__words_per_round;
+}
 
-        while (missing >= state->wordlen) {
+// Clearing an entry for each word costs about as much as clearing MEMLZ__SCRUB_RATIO bytes of
+// the tables, so larger data clear the full tables
+static int memlz__scrub_pays(const memlz_state* c, size_t len) {
+    return len <= MEMLZ__SCRUB_LIMIT && len <= ((sizeof(uint64_t) + sizeof(uint32_t)) << c->bits) / MEMLZ__SCRUB_RATIO;
+}
 
-            if (state->wordlen == 8) {
-                uint64_t a = memlz__hash64(*(uint64_t*)src);
-                MEMLZ__ENCODE_WORD(state->hash64, uint64_t, a, 0, )
-            }
-            else {
-                uint32_t a = memlz__hash32(*(uint32_t*)src);
-                MEMLZ__ENCODE_WORD(state->hash32, uint32_t, a, 0, )
-            }
+static void memlz__scrub(memlz_state* c, const void* data, size_t len) {
+    if (!memlz__scrub_pays(c, len)) {
+        memlz__reset_tables(c);
+        memlz__reset_fields(c);
+        return;
+    }
+    memlz__clear_entries(c, (const uint8_t*)data, len, len);
+    memlz__reset_fields(c);
+}
 
-            src += state->wordlen;
-            flags_left--;
-            missing -= state->wordlen;
-        }
+MEMLZ__UNUSED static size_t memlz_state_size() {
+    return sizeof(memlz_state);
+}
 
-        flags <<= flags_left;
-        *flag_ptr = flags;
+static size_t memlz_state_size_bits(int table_bits) {
+    return offsetof(memlz_state, tables) + ((sizeof(uint64_t) + sizeof(uint32_t)) << memlz__bits(table_bits));
+}
+
+// The checksum accumulates the data like XXH3, reading it as 8-byte words that are assigned to
+// 8 lanes by their position. Every block except the last one of a packet holds a multiple of 8
+// bytes, so the compressor and decompressor can update it every few blocks while they are in
+// the cache, and the result does not depend on how the data was split into blocks.
+static const uint64_t memlz__sum_key[8] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+    0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull
+};
+
+static void memlz__sum_init(memlz__sum* s) {
+    for (int j = 0; j < 8; j++) {
+        s->lanes[j] = memlz__sum_key[7 - j];
     }
+    s->words = 0;
+}
 
-    size_t tail_count = missing;
-    memcpy(dst, src, tail_count);
-    dst += tail_count;
+static void memlz__sum_word(memlz__sum* s, uint64_t x) {
+    const size_t j = s->words++ & 7;
+    const uint64_t dk = x ^ memlz__sum_key[j];
+    s->lanes[j ^ 1] += x;
+    s->lanes[j] += (dk & 0xffffffff) * (dk >> 32);
+}
 
-    size_t compressed_len = (size_t)(dst - (uint8_t*)destination);
-    if (compressed_len < memlz_header_len()) {
-        memset(dst, 'M', memlz_header_len() - compressed_len);
-        compressed_len = memlz_header_len();
+MEMLZ__UNUSED static void memlz__sum_scalar(uint64_t* lanes, const uint64_t* w, size_t stripes) {
+    for (size_t i = 0; i < stripes; i++) {
+        for (int j = 0; j < 8; j++) {
+            const uint64_t x = w[8 * i + j];
+            const uint64_t dk = x ^ memlz__sum_key[j];
+            lanes[j ^ 1] += x;
+            lanes[j] += (dk & 0xffffffff) * (dk >> 32);
+        }
     }
+}
 
-    memlz__write(destination, len, header_len / memlz__fields);
-    memlz__write((uint8_t*)destination + header_len / memlz__fields, compressed_len, header_len / memlz__fields);
+// Kernels of the hot loops that use SIMD instructions. Each kernel is compiled for its own
+// instruction set with a target attribute instead of for the instruction set of the build, so
+// that one binary can run on any CPU, and the best kernel is selected at runtime.
+#if defined(__GNUC__)
+#define MEMLZ__TARGET(t) __attribute__((target(t)))
+#else
+#define MEMLZ__TARGET(t)
+#endif
 
-    state->total_input += len;
-    state->total_output += compressed_len;
+MEMLZ__UNUSED static unsigned memlz__ctz(unsigned v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(v);
+#endif
+}
 
-    return compressed_len;
+// Returns how many of the first words of src are equal to its first word, starting the count
+// at e words that are already known to be equal. The result is at least 1.
+static size_t memlz__rle_scalar(const uint8_t* src, size_t e, size_t words) {
+    e = e ? e : 1;
+    while (e < words && ((const uint64_t*)src)[e] == *(const uint64_t*)src) {
+        e++;
+    }
+    return e;
 }
 
-static size_t memlz_decompressed_len(const void* src) {
-    return memlz__read(src);
+// Returns the index of the first word from index i on that is equal to the next word, or words
+// if there is none
+static size_t memlz__pair_scalar(const uint8_t* src, size_t i, size_t words) {
+    for (; i + 1 < words; i++) {
+        if (((const uint64_t*)src)[i] == ((const uint64_t*)src)[i + 1]) {
+            return i;
+        }
+    }
+    return words;
 }
 
-static size_t memlz_compressed_len(const void* src) {
-    size_t header_field_len = memlz__bytes(src);
-    return memlz__read((uint8_t*)src + header_field_len);
+// Byte shuffle of the filter, which stores byte j of record r of a block at j * records + r
+static void memlz__shuffle_scalar(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t stride, size_t records) {
+    for (size_t j = 0; j < stride; j++) {
+        for (size_t r = 0; r < records; r++) {
+            out[j * records + r] = in[r * stride + j];
+        }
+    }
+}
+
+static void memlz__unshuffle_scalar(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t stride, size_t records) {
+    for (size_t j = 0; j < stride; j++) {
+        for (size_t r = 0; r < records; r++) {
+            out[r * stride + j] = in[j * records + r];
+        }
+    }
 }
 
-#define MEMLZ__R(p, l) do { if ((p) < r1 || (l) > (size_t)((r2) - (p))) return 0; } while (0)
-#define MEMLZ__W(p, l) do { if ((p) < w1 || (l) > (size_t)((w2) - (p))) return 0; } while (0)
+// Vectorized encoding of a full round of 16 words. The hashes of all words are computed at
+// once and the table is read with gathers, which gives the same result as the scalar code
+// as long as no two words of the round hash to the same entry. The AVX2 kernels detect that
+// case and return 0 so that the caller encodes the round with the scalar code instead. Because
+// hits are already in the table, the table can be updated unconditionally for all words, and
+// each word is written to the output as 8 bytes of which only 2 are kept for a reference.
+#ifdef MEMLZ__X86
 
-static size_t memlz_stream_decompress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, memlz_state* state) {
-    if (state->reset != 'Y') {
-        return 0;
+// GCC 12 warns about the intrinsics headers in C++ when the AVX-512 intrinsics are inlined
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Turn a mask where bit i tells if word i was a hit into the flags of a round, which has word 0 at bit 15
+static uint16_t memlz__reverse16(unsigned m) {
+    m = ((m >> 1) & 0x5555) | ((m & 0x5555) << 1);
+    m = ((m >> 2) & 0x3333) | ((m & 0x3333) << 2);
+    m = ((m >> 4) & 0x0f0f) | ((m & 0x0f0f) << 4);
+    return (uint16_t)((m >> 8) | (m << 8));
+}
+
+#define MEMLZ__EMIT16(typ, tbl, hs, m) \
+    for (int i = 0; i < 16; i++) { \
+        typ v = ((const typ*)src)[i]; \
+        int hit = (m >> i) & 1; \
+        tbl[hs[i]] = v; \
+        *(typ*)d = hit ? (typ)hs[i] : v; \
+        d += hit ? 2 : sizeof(typ); \
     }
 
-    const size_t decompressed_len = memlz_decompressed_len(source);
-    const size_t compressed_len = memlz_compressed_len(source);
+// With AVX-512 the kernels also handle words that hash to the same entry as an earlier word of
+// the round. Such a word must be compared with the last of those earlier words instead of the
+// table, because the scalar code would have stored that word in the entry. This returns the
+// lane of that word for each lane, given the result of vpconflictd.
+MEMLZ__TARGET("avx512f,avx512cd") static __m512i memlz__last_conflict(__m512i conflicts) {
+    return _mm512_sub_epi32(_mm512_set1_epi32(31), _mm512_lzcnt_epi32(conflicts));
+}
 
-    if (compressed_len > memlz_max_compressed_len(decompressed_len)) {
+MEMLZ__TARGET("avx512f,avx512dq,avx512cd") static int memlz__round64_avx512(const uint8_t* src, uint8_t** dst, uint64_t* tbl, size_t bits, uint16_t* flags) {
+    const __m512i k = _mm512_set1_epi64((long long)11400714819323198485ull);
+    const __m128i shift = _mm_cvtsi32_si128((int)(64 - bits));
+    __m512i w0 = _mm512_loadu_si512((const void*)src);
+    __m512i w1 = _mm512_loadu_si512((const void*)(src + 64));
+    __m512i h0 = _mm512_srl_epi64(_mm512_mullo_epi64(w0, k), shift);
+    __m512i h1 = _mm512_srl_epi64(_mm512_mullo_epi64(w1, k), shift);
+
+    __m512i all = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(h0)), _mm512_cvtepi64_epi32(h1), 1);
+    __m512i conflicts = _mm512_conflict_epi32(all);
+    __mmask16 c = _mm512_test_epi32_mask(conflicts, conflicts);
+    __m512i last = memlz__last_conflict(conflicts);
+    __m512i prev0 = _mm512_permutex2var_epi64(w0, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(last)), w1);
+    __m512i prev1 = _mm512_permutex2var_epi64(w0, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(last, 1)), w1);
+    __m512i old0 = _mm512_mask_mov_epi64(_mm512_i64gather_epi64(h0, (const void*)tbl, 8), (__mmask8)c, prev0);
+    __m512i old1 = _mm512_mask_mov_epi64(_mm512_i64gather_epi64(h1, (const void*)tbl, 8), (__mmask8)(c >> 8), prev1);
+
+    unsigned m = _mm512_cmpeq_epi64_mask(old0, w0) | (unsigned)_mm512_cmpeq_epi64_mask(old1, w1) << 8;
+    uint32_t hs[16];
+    _mm512_storeu_si512((void*)hs, all);
+
+    uint8_t* d = *dst;
+    MEMLZ__EMIT16(uint64_t, tbl, hs, m)
+    *dst = d;
+    *flags = memlz__reverse16(m);
+    return 1;
+}
+
+MEMLZ__TARGET("avx512f,avx512dq,avx512cd") static int memlz__round32_avx512(const uint8_t* src, uint8_t** dst, uint32_t* tbl, size_t bits, uint16_t* flags) {
+    const __m512i k = _mm512_set1_epi64(2654435761ll);
+    const __m512i mask = _mm512_set1_epi64((long long)((1u << bits) - 1));
+    const __m128i shift = _mm_cvtsi32_si128((int)(32 - bits));
+    __m512i w = _mm512_loadu_si512((const void*)src);
+    __m512i even = _mm512_and_si512(_mm512_srl_epi64(_mm512_mul_epu32(w, k), shift), mask);
+    __m512i odd = _mm512_and_si512(_mm512_srl_epi64(_mm512_mul_epu32(_mm512_srli_epi64(w, 32), k), shift), mask);
+    __m512i h = _mm512_or_si512(even, _mm512_slli_epi64(odd, 32));
+
+    __m512i conflicts = _mm512_conflict_epi32(h);
+    __mmask16 c = _mm512_test_epi32_mask(conflicts, conflicts);
+    __m512i prev = _mm512_permutexvar_epi32(memlz__last_conflict(conflicts), w);
+    __m512i old = _mm512_mask_mov_epi32(_mm512_i32gather_epi32(h, (const void*)tbl, 4), c, prev);
+
+    unsigned m = _mm512_cmpeq_epi32_mask(old, w);
+    uint32_t hs[16];
+    _mm512_storeu_si512((void*)hs, h);
+
+    uint8_t* d = *dst;
+    MEMLZ__EMIT16(uint32_t, tbl, hs, m)
+    *dst = d;
+    *flags = memlz__reverse16(m);
+    return 1;
+}
+
+// Returns nonzero if any two of the 16 16-bit lanes are equal, by comparing with all rotations
+MEMLZ__TARGET("avx2") static int memlz__conflict16_avx2(__m256i x) {
+    __m256i t = _mm256_permute2x128_si256(x, x, 0x01);
+    __m256i eq = _mm256_cmpeq_epi16(x, t);
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 2)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 4)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 6)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 8)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 10)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 12)));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi16(x, _mm256_alignr_epi8(t, x, 14)));
+    return !_mm256_testz_si256(eq, eq);
+}
+
+// AVX2 has no 64-bit multiplication, so build it from three 32x32 bit multiplications
+MEMLZ__TARGET("avx2") static __m256i memlz__mullo64_avx2(__m256i x, __m256i k) {
+    __m256i lo = _mm256_mul_epu32(x, k);
+    __m256i c1 = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), k);
+    __m256i c2 = _mm256_mul_epu32(x, _mm256_srli_epi64(k, 32));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(_mm256_add_epi64(c1, c2), 32));
+}
+
+MEMLZ__TARGET("avx2") static int memlz__round64_avx2(const uint8_t* src, uint8_t** dst, uint64_t* tbl, size_t bits, uint16_t* flags) {
+    const __m256i k = _mm256_set1_epi64x((long long)11400714819323198485ull);
+    const __m128i shift = _mm_cvtsi32_si128((int)(64 - bits));
+    __m256i w[4];
+    __m256i h[4];
+    for (int i = 0; i < 4; i++) {
+        w[i] = _mm256_loadu_si256((const __m256i*)(src + 32 * i));
+        h[i] = _mm256_srl_epi64(memlz__mullo64_avx2(w[i], k), shift);
+    }
+
+    // All hashes are below 2^16, so pack them into 16-bit lanes in any order
+    __m256i lo = _mm256_or_si256(h[0], _mm256_slli_epi64(h[1], 32));
+    __m256i hi = _mm256_or_si256(h[2], _mm256_slli_epi64(h[3], 32));
+    if (memlz__conflict16_avx2(_mm256_or_si256(lo, _mm256_slli_epi64(hi, 16)))) {
         return 0;
     }
 
-    // For memory safe decompression
-    const uint8_t* r1 = (uint8_t*)source;
-    const uint8_t* r2 = (uint8_t*)source + compressed_len;
-    const uint8_t* w1 = (uint8_t*)destination;
-    const uint8_t* w2 = (uint8_t*)destination + decompressed_len;
+    unsigned m = 0;
+    uint64_t hs[16];
+    for (int i = 0; i < 4; i++) {
+        __m256i old = _mm256_i64gather_epi64((const long long*)tbl, h[i], 8);
+        m |= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(old, w[i]))) << (4 * i);
+        _mm256_storeu_si256((__m256i*)(hs + 4 * i), h[i]);
+    }
 
-    size_t header_length = memlz__bytes(source) * memlz__fields;
-    const uint8_t* src = (const uint8_t*)source + header_length;
-    uint8_t* dst = (uint8_t*)destination;
-    
-    size_t missing = decompressed_len;
-    size_t last_missing = 0;
+    uint8_t* d = *dst;
+    MEMLZ__EMIT16(uint64_t, tbl, hs, m)
+    *dst = d;
+    *flags = memlz__reverse16(m);
+    return 1;
+}
 
-    uint8_t blocktype = 0;
-    size_t memlz__wordlen = 0;
+MEMLZ__TARGET("avx2") static int memlz__round32_avx2(const uint8_t* src, uint8_t** dst, uint32_t* tbl, size_t bits, uint16_t* flags) {
+    const __m256i k = _mm256_set1_epi64x(2654435761ll);
+    const __m256i mask = _mm256_set1_epi64x((long long)((1u << bits) - 1));
+    const __m128i shift = _mm_cvtsi32_si128((int)(32 - bits));
+    __m256i w[2];
+    __m256i h[2];
+    for (int i = 0; i < 2; i++) {
+        w[i] = _mm256_loadu_si256((const __m256i*)(src + 32 * i));
+        __m256i even = _mm256_and_si256(_mm256_srl_epi64(_mm256_mul_epu32(w[i], k), shift), mask);
+        __m256i odd = _mm256_and_si256(_mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(w[i], 32), k), shift), mask);
+        h[i] = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+    }
 
-    for (;;) {
-        // Prevent infinite loops or slow advance 
-        const size_t min_advance = MEMLZ__MIN(64, MEMLZ__MIN(MEMLZ__INCOMPRESSIBLE_ADVANCE, MEMLZ__MIN_RLE));
-        if (last_missing != 0 && missing > last_missing + min_advance) {
-            return 0;
-        }
-        last_missing = missing;
+    if (memlz__conflict16_avx2(_mm256_or_si256(h[0], _mm256_slli_epi32(h[1], 16)))) {
+        return 0;
+    }
 
-        MEMLZ__R(src, 1);
-        blocktype = *(uint8_t*)src++;
+    unsigned m = 0;
+    uint32_t hs[16];
+    for (int i = 0; i < 2; i++) {
+        __m256i old = _mm256_i32gather_epi32((const int*)tbl, h[i], 4);
+        m |= (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(old, w[i]))) << (8 * i);
+        _mm256_storeu_si256((__m256i*)(hs + 8 * i), h[i]);
+    }
 
-#ifdef MEMLZ__DO_INCOMPRESSIBLE
-        if (blocktype == MEMLZ__UNCOMPRESSED) {
-            MEMLZ__R(src, 1);
-            size_t len = memlz__bytes(src);
-            MEMLZ__R(src, len);
-            size_t unc = memlz__read(src);
-            src += len;
-            MEMLZ__R(src, unc);
-            MEMLZ__W(dst, unc);
-            for (size_t n = 0; n < unc / sizeof(uint64_t); n++) {
-                ((uint64_t*)dst)[n] = ((uint64_t*)src)[n];
-            }
-            src += unc;
-            dst += unc;
-            missing -= unc;
-            continue;
-        }
-#endif
+    uint8_t* d = *dst;
+    MEMLZ__EMIT16(uint32_t, tbl, hs, m)
+    *dst = d;
+    *flags = memlz__reverse16(m);
+    return 1;
+}
 
-#ifdef MEMLZ__DO_RLE
-        if (blocktype == MEMLZ__RLE) {
-            MEMLZ__R(src, 1);
-            size_t len = memlz__bytes(src);
-            MEMLZ__R(src, len);
-            uint64_t z = memlz__read(src);
-            src += len;
-            MEMLZ__R(src, sizeof(uint64_t));
-            uint64_t v = *((uint64_t*)src);
-            src += sizeof(uint64_t);
-            MEMLZ__W(dst, z);
-            for (uint64_t n = 0; n < z / sizeof(uint64_t); n++) {
-                ((uint64_t*)dst)[n] = v;
-            }
-            dst += z;
-            missing -= z;
-            continue;
+// Add stripes of 8 words to the 8 lanes of the checksum. Each 128-bit vector holds a pair of
+// lanes, so that the words that are added to the neighbour lane are swapped within a vector.
+static void memlz__sum_sse2(uint64_t* lanes, const uint64_t* w, size_t stripes) {
+    __m128i acc[4];
+    __m128i key[4];
+    for (int j = 0; j < 4; j++) {
+        acc[j] = _mm_loadu_si128((const __m128i*)lanes + j);
+        key[j] = _mm_loadu_si128((const __m128i*)memlz__sum_key + j);
+    }
+    for (size_t i = 0; i < stripes; i++) {
+        for (int j = 0; j < 4; j++) {
+            const __m128i x = _mm_loadu_si128((const __m128i*)(w + 8 * i) + j);
+            const __m128i dk = _mm_xor_si128(x, key[j]);
+            acc[j] = _mm_add_epi64(acc[j], _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, 0x31)));
+            acc[j] = _mm_add_epi64(acc[j], _mm_shuffle_epi32(x, 0x4e));
         }
-#endif
+    }
+    for (int j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i*)lanes + j, acc[j]);
+    }
+}
 
-        if (blocktype == MEMLZ__NORMAL64) {
-            memlz__wordlen = 8;
-        }
-        else if (blocktype == MEMLZ__NORMAL32) {
-            memlz__wordlen = 4;
+MEMLZ__TARGET("avx2") static void memlz__sum_avx2(uint64_t* lanes, const uint64_t* w, size_t stripes) {
+    __m256i acc0 = _mm256_loadu_si256((const __m256i*)lanes);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i*)lanes + 1);
+    const __m256i key0 = _mm256_loadu_si256((const __m256i*)memlz__sum_key);
+    const __m256i key1 = _mm256_loadu_si256((const __m256i*)memlz__sum_key + 1);
+    for (size_t i = 0; i < stripes; i++) {
+        const __m256i x0 = _mm256_loadu_si256((const __m256i*)(w + 8 * i));
+        const __m256i x1 = _mm256_loadu_si256((const __m256i*)(w + 8 * i) + 1);
+        const __m256i dk0 = _mm256_xor_si256(x0, key0);
+        const __m256i dk1 = _mm256_xor_si256(x1, key1);
+        acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(dk0, _mm256_shuffle_epi32(dk0, 0x31)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(dk1, _mm256_shuffle_epi32(dk1, 0x31)));
+        acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(x0, 0x4e));
+        acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(x1, 0x4e));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc0);
+    _mm256_storeu_si256((__m256i*)lanes + 1, acc1);
+}
+
+MEMLZ__TARGET("avx512f") static void memlz__sum_avx512(uint64_t* lanes, const uint64_t* w, size_t stripes) {
+    __m512i acc = _mm512_loadu_si512((const void*)lanes);
+    const __m512i key = _mm512_loadu_si512((const void*)memlz__sum_key);
+    for (size_t i = 0; i < stripes; i++) {
+        const __m512i x = _mm512_loadu_si512((const void*)(w + 8 * i));
+        const __m512i dk = _mm512_xor_si512(x, key);
+        acc = _mm512_add_epi64(acc, _mm512_mul_epu32(dk, _mm512_shuffle_epi32(dk, (_MM_PERM_ENUM)0x31)));
+        acc = _mm512_add_epi64(acc, _mm512_shuffle_epi32(x, (_MM_PERM_ENUM)0x4e));
+    }
+    _mm512_storeu_si512((void*)lanes, acc);
+}
+
+// The RLE scans compare 16 bytes at a time with SSE4.1, which all CPUs with SSE4.2 have. Long
+// runs are first scanned 4 vectors at a time with a single test of the combined compares, and
+// the vector that ends the run is then found one vector at a time
+MEMLZ__TARGET("sse4.2") static size_t memlz__rle_sse42(const uint8_t* src, size_t words) {
+    if (words < 2) {
+        return 1;
+    }
+    const __m128i v = _mm_set1_epi64x(*(const long long*)src);
+    size_t e = 0;
+    for (; e + 8 <= words; e += 8) {
+        const __m128i a = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(src + 8 * e)), v);
+        const __m128i b = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(src + 8 * e + 16)), v);
+        const __m128i c = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(src + 8 * e + 32)), v);
+        const __m128i d = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(src + 8 * e + 48)), v);
+        if (!_mm_test_all_ones(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)))) {
+            break;
         }
-        else {
-            return 0;
+    }
+    for (; e + 2 <= words; e += 2) {
+        unsigned m = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_loadu_si128((const __m128i*)(src + 8 * e)), v)));
+        if (m != 3) {
+            return e + memlz__ctz(~m);
         }
+    }
+    return memlz__rle_scalar(src, e, words);
+}
 
-        if (missing < memlz__wordlen * 16) {
+MEMLZ__TARGET("avx2") static size_t memlz__rle_avx2(const uint8_t* src, size_t words) {
+    if (words < 2) {
+        return 1;
+    }
+    const __m256i v = _mm256_set1_epi64x(*(const long long*)src);
+    size_t e = 0;
+    for (; e + 16 <= words; e += 16) {
+        const __m256i a = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(src + 8 * e)), v);
+        const __m256i b = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(src + 8 * e + 32)), v);
+        const __m256i c = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(src + 8 * e + 64)), v);
+        const __m256i d = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(src + 8 * e + 96)), v);
+        if (!_mm256_testc_si256(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)), _mm256_set1_epi64x(-1))) {
             break;
         }
+    }
+    for (; e + 4 <= words; e += 4) {
+        unsigned m = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(src + 8 * e)), v)));
+        if (m != 15) {
+            return e + memlz__ctz(~m);
+        }
+    }
+    return memlz__rle_scalar(src, e, words);
+}
 
-        MEMLZ__R(src, 2);
-        uint16_t flags = *(uint16_t*)src;
-        src += 2;
+MEMLZ__TARGET("avx512f") static size_t memlz__rle_avx512(const uint8_t* src, size_t words) {
+    if (words < 2) {
+        return 1;
+    }
+    const __m512i v = _mm512_set1_epi64(*(const long long*)src);
+    size_t e = 0;
+    for (; e + 32 <= words; e += 32) {
+        const __mmask8 a = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(src + 8 * e)), v);
+        const __mmask8 b = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(src + 8 * e + 64)), v);
+        const __mmask8 c = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(src + 8 * e + 128)), v);
+        const __mmask8 d = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(src + 8 * e + 192)), v);
+        if ((a & b & c & d) != 255) {
+            break;
+        }
+    }
+    for (; e + 8 <= words; e += 8) {
+        unsigned m = (unsigned)_mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(src + 8 * e)), v);
+        if (m != 255) {
+            return e + memlz__ctz(~m);
+        }
+    }
+    return memlz__rle_scalar(src, e, words);
+}
 
+// The pair scans compare each vector of words with the same vector shifted by one word
+MEMLZ__TARGET("sse4.2") static size_t memlz__pair_sse42(const uint8_t* src, size_t words) {
+    size_t i = 0;
+    for (; i + 3 <= words; i += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(src + 8 * i));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(src + 8 * i + 8));
+        const unsigned m = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(a, b)));
+        if (m) {
+            return i + memlz__ctz(m);
+        }
+    }
+    return memlz__pair_scalar(src, i, words);
+}
 
-#define MEMLZ__DECODE_WORD(safe, h, tbl, typ, next) \
-        if (flags & 0b1000000000000000) { \
-            if(safe) { \
-                MEMLZ__R(src, 2); \
-            } \
-            word = tbl[*(uint16_t*)src]; \
-            src += 2; \
-            *(typ*)dst = word; \
-            dst += sizeof(typ); \
-            flags = (uint16_t)(flags << 1); \
-            next; \
-        } else { \
-            if(safe) { \
-                MEMLZ__R(src, sizeof(typ)); \
-            } \
-            word = *((const typ*)src); \
-            src += sizeof(typ); \
-            tbl[h(word)] = word; \
-            *(typ*)dst = word; \
-            dst += sizeof(typ); \
-            flags = (uint16_t)(flags << 1); \
-            next; \
-        } 
+MEMLZ__TARGET("avx2") static size_t memlz__pair_avx2(const uint8_t* src, size_t words) {
+    size_t i = 0;
+    for (; i + 5 <= words; i += 4) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)(src + 8 * i));
+        const __m256i b = _mm256_loadu_si256((const __m256i*)(src + 8 * i + 8));
+        const unsigned m = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b)));
+        if (m) {
+            return i + memlz__ctz(m);
+        }
+    }
+    return memlz__pair_scalar(src, i, words);
+}
 
+MEMLZ__TARGET("avx512f") static size_t memlz__pair_avx512(const uint8_t* src, size_t words) {
+    size_t i = 0;
+    for (; i + 9 <= words; i += 8) {
+        const __m512i a = _mm512_loadu_si512((const void*)(src + 8 * i));
+        const __m512i b = _mm512_loadu_si512((const void*)(src + 8 * i + 8));
+        const unsigned m = (unsigned)_mm512_cmpeq_epi64_mask(a, b);
+        if (m) {
+            return i + memlz__ctz(m);
+        }
+    }
+    return memlz__pair_scalar(src, i, words);
+}
 
-#define MEMLZ__DECODE4(safe, h, tbl, typ) MEMLZ__DECODE_WORD \
-                    (safe, h, tbl, typ, MEMLZ__DECODE_WORD \
-                    (safe, h, tbl, typ, MEMLZ__DECODE_WORD \
-                    (safe, h, tbl, typ, MEMLZ__DECODE_WORD \
-                    (safe, h, tbl, typ, ))))
+// The shuffles of 4 and 8-byte records take 16 records at a time. Each vector of records is
+// first sorted by byte with a byte shuffle, which leaves a matrix of 32 or 16-bit elements that
+// is transposed with unpacks. The transposes are their own inverse, and so is the byte shuffle
+// of 4-byte records.
+static void memlz__transpose4x4_sse2(__m128i* v) {
+    const __m128i a = _mm_unpacklo_epi32(v[0], v[1]);
+    const __m128i b = _mm_unpackhi_epi32(v[0], v[1]);
+    const __m128i c = _mm_unpacklo_epi32(v[2], v[3]);
+    const __m128i d = _mm_unpackhi_epi32(v[2], v[3]);
+    v[0] = _mm_unpacklo_epi64(a, c);
+    v[1] = _mm_unpackhi_epi64(a, c);
+    v[2] = _mm_unpacklo_epi64(b, d);
+    v[3] = _mm_unpackhi_epi64(b, d);
+}
 
+static void memlz__transpose8x8_sse2(__m128i* v) {
+    __m128i s[8];
+    __m128i t[8];
+    for (int i = 0; i < 4; i++) {
+        s[2 * i] = _mm_unpacklo_epi16(v[2 * i], v[2 * i + 1]);
+        s[2 * i + 1] = _mm_unpackhi_epi16(v[2 * i], v[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        t[4 * i] = _mm_unpacklo_epi32(s[4 * i], s[4 * i + 2]);
+        t[4 * i + 1] = _mm_unpackhi_epi32(s[4 * i], s[4 * i + 2]);
+        t[4 * i + 2] = _mm_unpacklo_epi32(s[4 * i + 1], s[4 * i + 3]);
+        t[4 * i + 3] = _mm_unpackhi_epi32(s[4 * i + 1], s[4 * i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        v[2 * i] = _mm_unpacklo_epi64(t[i], t[i + 4]);
+        v[2 * i + 1] = _mm_unpackhi_epi64(t[i], t[i + 4]);
+    }
+}
 
-        if (src + 16 * sizeof(uint64_t) < r2) {
-            if (blocktype == MEMLZ__NORMAL64) {
-                uint64_t word;
-                MEMLZ__W(dst, 16 * sizeof(word));
-                MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash64, state->hash64, uint64_t))
-                missing -= 16 * sizeof(uint64_t);
-            }
-            else {
-                uint32_t word;
-                MEMLZ__W(dst, 16 * sizeof(word));
-                MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash32, state->hash32, uint32_t))
-                missing -= 16 * sizeof(uint32_t);
-            }
+MEMLZ__TARGET("ssse3") static void memlz__shuffle4_ssse3(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t records) {
+    const __m128i m = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    for (size_t r = 0; r < records; r += 16) {
+        __m128i v[4];
+        for (int i = 0; i < 4; i++) {
+            v[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 4 * r) + i), m);
         }
-        else {
-            if (blocktype == MEMLZ__NORMAL64) {
-                uint64_t word;
-                MEMLZ__W(dst, 16 * sizeof(word));
-                MEMLZ__UNROLL4(MEMLZ__DECODE4(1, memlz__hash64, state->hash64, uint64_t))
-                missing -= 16 * sizeof(uint64_t);
-            }
-            else {
-                uint32_t word;
-                MEMLZ__W(dst, 16 * sizeof(word));
-                MEMLZ__UNROLL4(MEMLZ__DECODE4(1, memlz__hash32, state->hash32, uint32_t))
-                missing -= 16 * sizeof(uint32_t);
-            }
+        memlz__transpose4x4_sse2(v);
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_si128((__m128i*)(out + j * records + r), v[j]);
         }
     }
-    if (missing >= memlz__wordlen) {
-        MEMLZ__R(src, 2);
-        uint16_t flags = *(uint16_t*)src;
-        src += 2;
+}
 
-        while (missing >= memlz__wordlen) {
-            if (memlz__wordlen == 8) {
-                uint64_t word;
-                MEMLZ__W(dst, sizeof(word));
-                MEMLZ__DECODE_WORD(1, memlz__hash64, state->hash64, uint64_t,)
-            }
-            else {
-                uint32_t word;
-                MEMLZ__W(dst, sizeof(word));
-                MEMLZ__DECODE_WORD(1, memlz__hash32, state->hash32, uint32_t,)
-            }
-            missing -= memlz__wordlen;
+MEMLZ__TARGET("ssse3") static void memlz__unshuffle4_ssse3(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t records) {
+    const __m128i m = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    for (size_t r = 0; r < records; r += 16) {
+        __m128i v[4];
+        for (int j = 0; j < 4; j++) {
+            v[j] = _mm_loadu_si128((const __m128i*)(in + j * records + r));
+        }
+        memlz__transpose4x4_sse2(v);
+        for (int i = 0; i < 4; i++) {
+            _mm_storeu_si128((__m128i*)(out + 4 * r) + i, _mm_shuffle_epi8(v[i], m));
         }
     }
+}
 
-    size_t tail_count = missing;
-
-    while (tail_count) {
-        MEMLZ__R(src, 1);
-        MEMLZ__W(dst, 1);
-        *dst++ = *src++;
-        tail_count--;
+MEMLZ__TARGET("ssse3") static void memlz__shuffle8_ssse3(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t records) {
+    const __m128i m = _mm_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+    for (size_t r = 0; r < records; r += 16) {
+        __m128i v[8];
+        for (int i = 0; i < 8; i++) {
+            v[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 8 * r) + i), m);
+        }
+        memlz__transpose8x8_sse2(v);
+        for (int j = 0; j < 8; j++) {
+            _mm_storeu_si128((__m128i*)(out + j * records + r), v[j]);
+        }
     }
-    
-    state->total_input += compressed_len;
-    state->total_output += decompressed_len;
-    return decompressed_len;
 }
- 
-MEMLZ__UNUSED static size_t memlz_decompress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source) {
-    memlz_state* s = (memlz_state*)malloc(sizeof(memlz_state));
-    if (!s) {
-        return 0;
+
+MEMLZ__TARGET("ssse3") static void memlz__unshuffle8_ssse3(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t records) {
+    const __m128i m = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    for (size_t r = 0; r < records; r += 16) {
+        __m128i v[8];
+        for (int j = 0; j < 8; j++) {
+            v[j] = _mm_loadu_si128((const __m128i*)(in + j * records + r));
+        }
+        memlz__transpose8x8_sse2(v);
+        for (int i = 0; i < 8; i++) {
+            _mm_storeu_si128((__m128i*)(out + 8 * r) + i, _mm_shuffle_epi8(v[i], m));
+        }
     }
-    memlz_reset(s);
-    size_t r = memlz_stream_decompress(destination, source, s);
-    free(s);
-    return r;
 }
- 
 
-MEMLZ__UNUSED static size_t memlz_compress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len) {
-    memlz_state* s = (memlz_state*)malloc(sizeof(memlz_state));
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+#ifdef MEMLZ__NEON
+static size_t memlz__rle_neon(const uint8_t* src, size_t words) {
+    if (words < 2) {
+        return 1;
+    }
+    const uint64x2_t v = vdupq_n_u64(*(const uint64_t*)src);
+    size_t e = 0;
+    for (; e + 8 <= words; e += 8) {
+        const uint64x2_t a = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * e)), v);
+        const uint64x2_t b = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * e + 16)), v);
+        const uint64x2_t c = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * e + 32)), v);
+        const uint64x2_t d = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * e + 48)), v);
+        const uint64x2_t all = vandq_u64(vandq_u64(a, b), vandq_u64(c, d));
+        if (!(vgetq_lane_u64(all, 0) & vgetq_lane_u64(all, 1) & 1)) {
+            break;
+        }
+    }
+    for (; e + 2 <= words; e += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * e)), v);
+        if (!vgetq_lane_u64(eq, 0)) {
+            return e;
+        }
+        if (!vgetq_lane_u64(eq, 1)) {
+            return e + 1;
+        }
+    }
+    return memlz__rle_scalar(src, e, words);
+}
+
+static size_t memlz__pair_neon(const uint8_t* src, size_t words) {
+    size_t i = 0;
+    for (; i + 3 <= words; i += 2) {
+        const uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t*)(src + 8 * i)), vld1q_u64((const uint64_t*)(src + 8 * i + 8)));
+        if (vgetq_lane_u64(eq, 0)) {
+            return i;
+        }
+        if (vgetq_lane_u64(eq, 1)) {
+            return i + 1;
+        }
+    }
+    return memlz__pair_scalar(src, i, words);
+}
+#endif
+
+#ifdef MEMLZ__NEON
+#define MEMLZ__NEON_RLE(k, src, words) (k) == MEMLZ_KERNEL_NEON ? memlz__rle_neon(src, words) :
+#define MEMLZ__NEON_PAIR(k, src, words) (k) == MEMLZ_KERNEL_NEON ? memlz__pair_neon(src, words) :
+#else
+#define MEMLZ__NEON_RLE(k, src, words)
+#define MEMLZ__NEON_PAIR(k, src, words)
+#endif
+
+#ifdef MEMLZ__X86
+// Data with many repeated words makes the kernels give up often, so skip them for a while after
+// that. Rounds where nearly all words are hits are faster with the scalar code, whose branches
+// are then well predicted, so skip the kernels for a shorter while after such rounds as well.
+#define MEMLZ__ROUND(k, typ, src, dst, tbl, bits, flags) ((k) >= MEMLZ_KERNEL_AVX2 && (k) <= MEMLZ_KERNEL_AVX512 && \
+    (state->backoff ? (state->backoff--, 0) : \
+    ((k) == MEMLZ_KERNEL_AVX512 ? memlz__round##typ##_avx512(src, dst, tbl, bits, flags) : memlz__round##typ##_avx2(src, dst, tbl, bits, flags)) ? \
+    (memlz__popcount16(*(flags)) > MEMLZ__SIMD_HITS ? (state->backoff = MEMLZ__SIMD_HITS_BACKOFF, 1) : 1) : \
+    (state->backoff = MEMLZ__SIMD_BACKOFF, 0)))
+#define MEMLZ__RLE_WORDS(k, src, words) ((k) == MEMLZ_KERNEL_AVX512 ? memlz__rle_avx512(src, words) : \
+    (k) == MEMLZ_KERNEL_AVX2 ? memlz__rle_avx2(src, words) : (k) == MEMLZ_KERNEL_SSE42 ? memlz__rle_sse42(src, words) : \
+    memlz__rle_scalar(src, 1, words))
+#define MEMLZ__PAIR(k, src, words) ((k) == MEMLZ_KERNEL_AVX512 ? memlz__pair_avx512(src, words) : \
+    (k) == MEMLZ_KERNEL_AVX2 ? memlz__pair_avx2(src, words) : (k) == MEMLZ_KERNEL_SSE42 ? memlz__pair_sse42(src, words) : \
+    memlz__pair_scalar(src, 0, words))
+#else
+#define MEMLZ__ROUND(k, typ, src, dst, tbl, bits, flags) 0
+#define MEMLZ__RLE_WORDS(k, src, words) (MEMLZ__NEON_RLE(k, src, words) memlz__rle_scalar(src, 1, words))
+#define MEMLZ__PAIR(k, src, words) (MEMLZ__NEON_PAIR(k, src, words) memlz__pair_scalar(src, 0, words))
+#endif
+
+#define MEMLZ__ROUND64(src, dst, tbl, bits, flags) MEMLZ__ROUND(kernel, 64, src, dst, tbl, bits, flags)
+#define MEMLZ__ROUND32(src, dst, tbl, bits, flags) MEMLZ__ROUND(kernel, 32, src, dst, tbl, bits, flags)
+
+#ifdef _MSC_VER
+#define MEMLZ__INLINE __forceinline
+#define MEMLZ__NOINLINE __declspec(noinline)
+#else
+#define MEMLZ__INLINE inline __attribute__((always_inline))
+#define MEMLZ__NOINLINE __attribute__((noinline))
+#endif
+
+#if defined(__GNUC__)
+#define MEMLZ__PREFETCH(p) __builtin_prefetch(p)
+#elif defined(MEMLZ__X86)
+#define MEMLZ__PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define MEMLZ__PREFETCH(p)
+#endif
+
+// Add len bytes, which must be a multiple of 8. Whole stripes of 8 words that start at lane 0
+// are added by the SIMD kernel
+static MEMLZ__INLINE void memlz__sum_update(memlz__sum* MEMLZ__RESTRICT s, const uint8_t* MEMLZ__RESTRICT p, size_t len, const int kernel) {
+    const uint64_t* w = (const uint64_t*)p;
+    size_t n = len / sizeof(uint64_t);
+    for (; n > 0 && (s->words & 7); n--) {
+        memlz__sum_word(s, *w++);
+    }
+    const size_t stripes = n / 8;
+#ifdef MEMLZ__X86
+    if (kernel == MEMLZ_KERNEL_AVX512) {
+        memlz__sum_avx512(s->lanes, w, stripes);
+    }
+    else if (kernel == MEMLZ_KERNEL_AVX2) {
+        memlz__sum_avx2(s->lanes, w, stripes);
+    }
+    else {
+        memlz__sum_sse2(s->lanes, w, stripes);
+    }
+#else
+    (void)kernel;
+    memlz__sum_scalar(s->lanes, w, stripes);
+#endif
+    s->words += 8 * stripes;
+    w += 8 * stripes;
+    for (n -= 8 * stripes; n > 0; n--) {
+        memlz__sum_word(s, *w++);
+    }
+}
+
+// Add the last len bytes, which can be any number, and return the checksum
+static MEMLZ__INLINE uint64_t memlz__sum_final(memlz__sum* s, const uint8_t* p, size_t len, const int kernel) {
+    const size_t whole = len & ~(sizeof(uint64_t) - 1);
+    memlz__sum_update(s, p, whole, kernel);
+    const uint64_t total = s->words * sizeof(uint64_t) + len - whole;
+    if (len > whole) {
+        uint64_t last = 0;
+        memcpy(&last, p + whole, len - whole);
+        memlz__sum_word(s, last);
+    }
+    uint64_t h = total * MEMLZ__P1;
+    for (int j = 0; j < 8; j++) {
+        uint64_t a = s->lanes[j] * MEMLZ__P2;
+        a = MEMLZ__ROTL64(a, 31) * MEMLZ__P1;
+        h = MEMLZ__ROTL64(h ^ a, 27) * MEMLZ__P1 + MEMLZ__P4;
+    }
+    h ^= h >> 33;
+    h *= MEMLZ__P2;
+    h ^= h >> 29;
+    h *= MEMLZ__P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// The filter works on blocks of whole records that are about 1 KB, and at least 8 records, so
+// that blocks are multiples of 8 bytes. A block is only shuffled if it is whole, which all
+// blocks of a packet are except the last one.
+static size_t memlz__filter_block_len(size_t stride) {
+    return stride * 8 * (stride <= 128 ? 128 / stride : 1);
+}
+
+static void memlz__shuffle(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t stride, size_t records, int kernel) {
+#ifdef MEMLZ__X86
+    if (kernel >= MEMLZ_KERNEL_SSE42 && stride == 4) {
+        memlz__shuffle4_ssse3(out, in, records);
+        return;
+    }
+    if (kernel >= MEMLZ_KERNEL_SSE42 && stride == 8) {
+        memlz__shuffle8_ssse3(out, in, records);
+        return;
+    }
+#endif
+    (void)kernel;
+    memlz__shuffle_scalar(out, in, stride, records);
+}
+
+static void memlz__unshuffle(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT in, size_t stride, size_t records, int kernel) {
+#ifdef MEMLZ__X86
+    if (kernel >= MEMLZ_KERNEL_SSE42 && stride == 4) {
+        memlz__unshuffle4_ssse3(out, in, records);
+        return;
+    }
+    if (kernel >= MEMLZ_KERNEL_SSE42 && stride == 8) {
+        memlz__unshuffle8_ssse3(out, in, records);
+        return;
+    }
+#endif
+    (void)kernel;
+    memlz__unshuffle_scalar(out, in, stride, records);
+}
+
+// Bytewise subtraction and addition of 8 bytes at a time, where the top bit of each byte is
+// handled separately so that no carry crosses into the next byte
+static uint64_t memlz__sub8(uint64_t a, uint64_t b) {
+    const uint64_t h = 0x8080808080808080ull;
+    return ((a | h) - (b & ~h)) ^ ((a ^ ~b) & h);
+}
+
+static uint64_t memlz__add8(uint64_t a, uint64_t b) {
+    const uint64_t h = 0x8080808080808080ull;
+    return ((a & ~h) + (b & ~h)) ^ ((a ^ b) & h);
+}
+
+// Filter n bytes of a block at a stream position, where raw points to the input at the position
+// and the stride bytes before it are readable if it is not 0
+static void memlz__filter_block(uint8_t* MEMLZ__RESTRICT out, const uint8_t* MEMLZ__RESTRICT raw, size_t pos, size_t n, unsigned filter, size_t stride, int kernel) {
+    const size_t block = memlz__filter_block_len(stride);
+    const int shuffle = (filter & MEMLZ_FILTER_SHUFFLE) && n == block;
+    uint8_t tmp[MEMLZ__MAX_FILTER_BLOCK];
+    const uint8_t* d = raw;
+
+    if (filter & (MEMLZ_FILTER_DELTA | MEMLZ_FILTER_XOR)) {
+        uint8_t* t = shuffle ? tmp : out;
+        size_t i = pos ? 0 : MEMLZ__MIN(stride, n);
+        memcpy(t, raw, i);
+        for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+            uint64_t a, b;
+            memcpy(&a, raw + i, sizeof(a));
+            memcpy(&b, raw + i - stride, sizeof(b));
+            a = filter & MEMLZ_FILTER_XOR ? a ^ b : memlz__sub8(a, b);
+            memcpy(t + i, &a, sizeof(a));
+        }
+        for (; i < n; i++) {
+            t[i] = (uint8_t)(filter & MEMLZ_FILTER_XOR ? raw[i] ^ raw[i - stride] : raw[i] - raw[i - stride]);
+        }
+        d = t;
+    }
+
+    if (shuffle) {
+        memlz__shuffle(out, d, stride, block / stride, kernel);
+    }
+    else if (d != out) {
+        memcpy(out, d, n);
+    }
+}
+
+// Reverse the filter in place for the data of a packet from a block boundary to another block
+// boundary or to the end of the packet. The data before from must be reversed already, because
+// the delta of a record is added to the previous record.
+static void memlz__unfilter(uint8_t* data, size_t from, size_t to, unsigned filter, size_t stride, int kernel) {
+    const size_t block = memlz__filter_block_len(stride);
+    uint8_t tmp[MEMLZ__MAX_FILTER_BLOCK];
+
+    for (size_t pos = from; pos < to; pos += block) {
+        const size_t n = MEMLZ__MIN(block, to - pos);
+        uint8_t* x = data + pos;
+        const uint8_t* d = x;
+        if ((filter & MEMLZ_FILTER_SHUFFLE) && n == block) {
+            memlz__unshuffle(tmp, x, stride, block / stride, kernel);
+            d = tmp;
+        }
+
+        if (filter & (MEMLZ_FILTER_DELTA | MEMLZ_FILTER_XOR)) {
+            size_t i = pos ? 0 : MEMLZ__MIN(stride, n);
+            memmove(x, d, i);
+            const int xor_ = (filter & MEMLZ_FILTER_XOR) != 0;
+            if (stride >= 8) {
+                // Each word adds the word one record before it, which is complete
+                for (; i + 8 <= n; i += 8) {
+                    uint64_t a, b;
+                    memcpy(&a, d + i, sizeof(a));
+                    memcpy(&b, x + i - stride, sizeof(b));
+                    a = xor_ ? a ^ b : memlz__add8(a, b);
+                    memcpy(x + i, &a, sizeof(a));
+                }
+            }
+            else if (i + 8 <= n) {
+                // Records are shorter than a word, so each word adds the last bytes of the word
+                // before it, which is kept in a register, and then itself shifted by one record,
+                // two records and so on
+                uint64_t last;
+                memcpy(&last, x + i - stride, sizeof(last));
+                last <<= 8 * (8 - stride);
+                for (; i + 8 <= n; i += 8) {
+                    uint64_t a;
+                    memcpy(&a, d + i, sizeof(a));
+                    a = xor_ ? a ^ (last >> 8 * (8 - stride)) : memlz__add8(a, last >> 8 * (8 - stride));
+                    for (size_t shift = stride; shift < 8; shift *= 2) {
+                        a = xor_ ? a ^ (a << 8 * shift) : memlz__add8(a, a << 8 * shift);
+                    }
+                    memcpy(x + i, &a, sizeof(a));
+                    last = a;
+                }
+            }
+            for (; i < n; i++) {
+                x[i] = (uint8_t)(xor_ ? d[i] ^ x[i - stride] : d[i] + x[i - stride]);
+            }
+        }
+        else if (d != x) {
+            memcpy(x, d, n);
+        }
+    }
+}
+
+// The compressor reads its input through a window of contiguous bytes, which is the input
+// itself if it is a single buffer. If it is a list of segments, the window is a segment, or a
+// copy in gather of the bytes around the boundary between segments. A window holds at least
+// MEMLZ__LOOKAHEAD bytes or the rest of the input, which is what one round, an uncompressed
+// block and the start of a run read. Only runs can continue past the window, except with a
+// filter, where the window is always filtered data in gather.
+typedef struct memlz__cursor {
+    size_t seg; // Segment that holds a stream position
+    size_t pos; // Stream position of the start of seg
+} memlz__cursor;
+
+typedef struct memlz__input {
+    const memlz_iovec* iov;
+    size_t count;
+    memlz__cursor cursor;
+    unsigned filter;
+    size_t stride;
+    size_t filtered_pos; // Stream position and length of the filtered data in gather
+    size_t filtered_len;
+    uint8_t gather[MEMLZ__GATHER];
+} memlz__input;
+
+// Returns a pointer to a stream position that is not before the cursor, and the number of bytes
+// after it in its segment
+static const uint8_t* memlz__input_at(const memlz__input* in, memlz__cursor* c, size_t pos, size_t* avail) {
+    while (c->seg + 1 < in->count && pos - c->pos >= in->iov[c->seg].iov_len) {
+        c->pos += in->iov[c->seg].iov_len;
+        c->seg++;
+    }
+    *avail = in->iov[c->seg].iov_len - (pos - c->pos);
+    return (const uint8_t*)in->iov[c->seg].iov_base + (pos - c->pos);
+}
+
+static void memlz__input_copy(const memlz__input* in, memlz__cursor c, size_t pos, uint8_t* dst, size_t len) {
+    while (len > 0) {
+        size_t avail;
+        const uint8_t* p = memlz__input_at(in, &c, pos, &avail);
+        const size_t n = MEMLZ__MIN(avail, len);
+        memcpy(dst, p, n);
+        dst += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+// Filters the whole blocks from the block that a stream position is in, as many as gather holds.
+// The blocks that the previous window shares with it are moved instead of filtered again.
+static const uint8_t* memlz__filtered_window(memlz__input* in, size_t pos, size_t missing, const uint8_t** end, int kernel) {
+    const size_t block = memlz__filter_block_len(in->stride);
+    const size_t start = pos - pos % block;
+    const size_t n = MEMLZ__MIN(sizeof(in->gather) / block * block, pos + missing - start);
+    size_t keep = 0;
+    if (start >= in->filtered_pos && start < in->filtered_pos + in->filtered_len) {
+        keep = in->filtered_pos + in->filtered_len - start;
+        memmove(in->gather, in->gather + (start - in->filtered_pos), keep);
+    }
+
+    uint8_t raw[MEMLZ__MAX_STRIDE + MEMLZ__MAX_FILTER_BLOCK];
+    for (size_t f = start + keep; f < start + n; f += block) {
+        const size_t len = MEMLZ__MIN(block, start + n - f);
+        const size_t prev = f ? in->stride : 0;
+        size_t avail;
+        const uint8_t* p = memlz__input_at(in, &in->cursor, f - prev, &avail);
+        if (avail < prev + len) {
+            memlz__input_copy(in, in->cursor, f - prev, raw, prev + len);
+            p = raw;
+        }
+        memlz__filter_block(in->gather + (f - start), p + prev, f, len, in->filter, in->stride, kernel);
+    }
+    in->filtered_pos = start;
+    in->filtered_len = n;
+    *end = in->gather + n;
+    return in->gather + (pos - start);
+}
+
+// Returns the window at a stream position with missing bytes of input after it
+static const uint8_t* memlz__window(memlz__input* in, size_t pos, size_t missing, const uint8_t** end, int kernel) {
+    if (in->count == 0) {
+        *end = in->gather;
+        return in->gather;
+    }
+    if (in->filter) {
+        return memlz__filtered_window(in, pos, missing, end, kernel);
+    }
+    size_t avail;
+    const uint8_t* p = memlz__input_at(in, &in->cursor, pos, &avail);
+    if (avail >= MEMLZ__MIN(MEMLZ__LOOKAHEAD, missing)) {
+        *end = p + avail;
+        return p;
+    }
+    const size_t n = MEMLZ__MIN(sizeof(in->gather), missing);
+    memlz__input_copy(in, in->cursor, pos, in->gather, n);
+    *end = in->gather + n;
+    return in->gather;
+}
+
+// Returns how many words that are equal to v begin at a stream position, up to words
+static MEMLZ__INLINE size_t memlz__input_rle(const memlz__input* in, size_t pos, uint64_t v, size_t words, const int kernel) {
+    (void)kernel;
+    memlz__cursor c = in->cursor;
+    size_t e = 0;
+    while (e < words) {
+        size_t avail;
+        const uint8_t* p = memlz__input_at(in, &c, pos, &avail);
+        uint64_t w;
+        if (avail >= sizeof(uint64_t)) {
+            const size_t n = MEMLZ__MIN(avail / sizeof(uint64_t), words - e);
+            const size_t k = *(const uint64_t*)p == v ? MEMLZ__RLE_WORDS(kernel, p, n) : 0;
+            e += k;
+            pos += k * sizeof(uint64_t);
+            if (k < n) {
+                break;
+            }
+        }
+        else {
+            // The word straddles segments
+            memlz__input_copy(in, c, pos, (uint8_t*)&w, sizeof(w));
+            if (w != v) {
+                break;
+            }
+            e++;
+            pos += sizeof(uint64_t);
+        }
+    }
+    return e;
+}
+
+// Add the input from stream position from to to, which is a multiple of 8 bytes, to a checksum
+static MEMLZ__INLINE void memlz__input_sum(const memlz__input* in, memlz__sum* s, size_t from, size_t to, const int kernel) {
+    memlz__cursor c = in->cursor;
+    while (from < to) {
+        size_t avail;
+        const uint8_t* p = memlz__input_at(in, &c, from, &avail);
+        const size_t n = MEMLZ__MIN(avail, to - from) & ~(sizeof(uint64_t) - 1);
+        if (n > 0) {
+            memlz__sum_update(s, p, n, kernel);
+            from += n;
+        }
+        else {
+            uint8_t w[sizeof(uint64_t)];
+            memlz__input_copy(in, c, from, w, sizeof(w));
+            memlz__sum_update(s, w, sizeof(w), kernel);
+            from += sizeof(w);
+        }
+    }
+}
+
+// Rounds without hits are followed by uncompressed blocks that grow with the number of such
+// rounds in a row. Once the blocks have reached full size, one follows every round without
+// hits. Returns the length of the block after a round, or 0 for none
+static MEMLZ__INLINE size_t memlz__incompressible_len(size_t rounds, size_t missing) {
+    if (rounds == 0 || missing < MEMLZ__INCOMPRESSIBLE_ADVANCE || (rounds % MEMLZ__INCOMPRESSIBLE_TRIGGER != 0 && rounds <= MEMLZ__INCOMPRESSIBLE_STREAK)) {
+        return 0;
+    }
+    size_t u = MEMLZ__INCOMPRESSIBLE_ADVANCE * rounds;
+    u = u > missing ? missing : u;
+    u = u > 1024 ? 1024 : u;
+    return u & ~(sizeof(uint64_t) - 1);
+}
+
+// Returns how many of the u bytes at src come before the first run of at least MEMLZ__MIN_RLE
+// bytes, which an uncompressed block stops at so that the next iteration encodes the run as an
+// RLE block, or u if there is none
+static MEMLZ__INLINE size_t memlz__store_len(const uint8_t* src, size_t u, const int kernel) {
+    (void)kernel;
+    const size_t words = u / sizeof(uint64_t);
+    const size_t run = MEMLZ__MIN_RLE / sizeof(uint64_t);
+    for (size_t i = 0; i + run <= words; i++) {
+        i += MEMLZ__PAIR(kernel, src + i * sizeof(uint64_t), words - i);
+        if (i + run <= words && memlz__rle_scalar(src + i * sizeof(uint64_t), 2, run) == run) {
+            return i * sizeof(uint64_t);
+        }
+    }
+    return u;
+}
+
+// The compressor is compiled once for each kernel by inlining its body, which takes the kernel
+// as a constant, into functions with the target attribute of the kernel. That lets the compiler
+// use the instruction set in the scalar code as well, and keeps the kernels inlined into the loop.
+// The decompressor has no kernels in its loop and is compiled once.
+static int memlz__kernel = MEMLZ_KERNEL_AUTO;
+
+// The kernel is selected lazily by whichever thread calls memlz first, so it is accessed
+// atomically. Threads that race to select it store the same value.
+static int memlz__load_kernel(void) {
+#ifdef __GNUC__
+    return __atomic_load_n(&memlz__kernel, __ATOMIC_RELAXED);
+#else
+    // Aligned int accesses are atomic on the platforms that MSVC targets
+    return *(volatile int*)&memlz__kernel;
+#endif
+}
+
+static void memlz__store_kernel(int kernel) {
+#ifdef __GNUC__
+    __atomic_store_n(&memlz__kernel, kernel, __ATOMIC_RELAXED);
+#else
+    *(volatile int*)&memlz__kernel = kernel;
+#endif
+}
+
+// Returns the best kernel that the CPU supports. The x86 kernels are numbered by the order of
+// their instruction sets, so the CPU also supports all kernels below the best one.
+static int memlz__cpu_kernel(void) {
+#if defined(MEMLZ__X86) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("bmi2")) {
+        return MEMLZ_KERNEL_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        return MEMLZ_KERNEL_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return MEMLZ_KERNEL_SSE42;
+    }
+#elif defined(MEMLZ__X86)
+    // Bits of CPUID leaf 1 and 7 and of XCR0, which tells if the OS saves the vector registers
+    int r[4];
+    __cpuid(r, 0);
+    int leaves = r[0];
+    __cpuid(r, 1);
+    int sse42 = (r[2] >> 20) & 1;
+    unsigned long long xcr0 = (r[2] >> 27) & 1 ? _xgetbv(0) : 0;
+    if (leaves >= 7) {
+        __cpuidex(r, 7, 0);
+        if ((xcr0 & 0xe6) == 0xe6 && (r[1] >> 16 & 1) && (r[1] >> 17 & 1) && (r[1] >> 28 & 1) && (r[1] >> 8 & 1)) {
+            return MEMLZ_KERNEL_AVX512;
+        }
+        if ((xcr0 & 6) == 6 && (r[1] >> 5 & 1) && (r[1] >> 8 & 1)) {
+            return MEMLZ_KERNEL_AVX2;
+        }
+    }
+    if (sse42) {
+        return MEMLZ_KERNEL_SSE42;
+    }
+#elif defined(MEMLZ__NEON)
+    return MEMLZ_KERNEL_NEON;
+#endif
+    return MEMLZ_KERNEL_SCALAR;
+}
+
+static int memlz_select_kernel(int kernel) {
+    const int best = memlz__cpu_kernel();
+    if (kernel == MEMLZ_KERNEL_AUTO) {
+        // The AVX2 and AVX-512 round kernels were slower than the scalar code on source code, and
+        // AVX2 also on incompressible data, so they must be selected explicitly
+        kernel = best == MEMLZ_KERNEL_AVX2 || best == MEMLZ_KERNEL_AVX512 ? MEMLZ_KERNEL_SSE42 : best;
+    }
+    if (kernel != MEMLZ_KERNEL_SCALAR && kernel != best && (best == MEMLZ_KERNEL_NEON || kernel == MEMLZ_KERNEL_NEON || kernel > best)) {
+        kernel = MEMLZ_KERNEL_SCALAR;
+    }
+    memlz__store_kernel(kernel);
+    return kernel;
+}
+
+static int memlz__selected_kernel(void) {
+    const int kernel = memlz__load_kernel();
+    return kernel == MEMLZ_KERNEL_AUTO ? memlz_select_kernel(MEMLZ_KERNEL_AUTO) : kernel;
+}
+
+// The fingerprint of a page is a hash of words that are spread over it
+#define MEMLZ__PAGE_SAMPLE(p, i) ((const uint8_t*)(p) + (i) * (MEMLZ__PAGE / MEMLZ__PAGE_SAMPLES + sizeof(uint64_t)))
+
+static void memlz__page_prefetch(const uint8_t* p) {
+    for (size_t i = 0; i < MEMLZ__PAGE_SAMPLES; i++) {
+        MEMLZ__PREFETCH(MEMLZ__PAGE_SAMPLE(p, i));
+    }
+}
+
+// The page index has an entry for each of 2^bits fingerprints, with the low 32 bits of the last
+// fingerprint that went there and the number plus 1 of its page, so that pages are only compared
+// when their fingerprints are equal. Returns the distance back to an earlier page of the packet
+// that is equal to the page at pos, or 0 after adding the page to the index
+static size_t memlz__page_match(uint64_t* index, size_t bits, const uint8_t* data, size_t pos) {
+    const uint8_t* p = data + pos;
+    uint64_t h = 0;
+    for (size_t i = 0; i < MEMLZ__PAGE_SAMPLES; i++) {
+        h = (h ^ *(const uint64_t*)MEMLZ__PAGE_SAMPLE(p, i)) * MEMLZ__P1;
+    }
+    uint64_t* slot = index + (h >> (64 - bits));
+    if ((uint32_t)*slot && (uint32_t)(*slot >> 32) == (uint32_t)h) {
+        const size_t earlier = (size_t)((uint32_t)*slot - 1) * MEMLZ__PAGE;
+        if (!memcmp(data + earlier, p, MEMLZ__PAGE)) {
+            return pos - earlier;
+        }
+    }
+    *slot = (h << 32) | (pos / MEMLZ__PAGE + 1);
+    return 0;
+}
+
+#define MEMLZ__ENCODE_WORD(tbl, typ, h, i, next) \
+    flags <<= 1; \
+    if (tbl[h] == ((typ*)src)[i]) { \
+        flags |= 1; \
+        *(uint16_t*)dst = (uint16_t)h; \
+        dst += 2; \
+        next; \
+    } else { \
+        tbl[h] = ((typ*)src)[i]; \
+        *(typ*)dst = ((typ*)src)[i]; \
+        dst += sizeof(typ); \
+        next; \
+    }
+
+#define MEMLZ__ENCODE4(tbl, typ, a, b, c, d) MEMLZ__ENCODE_WORD \
+        (tbl, typ, a, 0, MEMLZ__ENCODE_WORD \
+        (tbl, typ, b, 1, MEMLZ__ENCODE_WORD \
+        (tbl, typ, c, 2, MEMLZ__ENCODE_WORD \
+        (tbl, typ, d, 3, ))))
+
+#define MEMLZ__ENCODE_ROUND(h, tbl, typ, hb) { \
+        typ a, b, c, d; \
+        MEMLZ__UNROLL4( \
+            a = h(((typ*)src)[0], hb); \
+            b = h(((typ*)src)[1], hb); \
+            c = h(((typ*)src)[2], hb); \
+            d = h(((typ*)src)[3], hb); \
+            MEMLZ__ENCODE4(tbl, typ, a, b, c, d); \
+            src += 4 * sizeof(typ); \
+        ) \
+    }
+
+// Encode a round with a table size other than the default. Like memlz__decode_round64(), it is kept
+// out of the loop, which then hashes with a constant shift. Returns the end of the output
+static MEMLZ__NOINLINE uint8_t* memlz__encode_round64(const uint8_t* src, uint8_t* dst, uint16_t* round_flags, uint64_t* hash64, size_t bits) {
+    uint16_t flags = 0;
+    MEMLZ__ENCODE_ROUND(memlz__hash64, hash64, uint64_t, bits)
+    *round_flags = flags;
+    return dst;
+}
+
+static MEMLZ__NOINLINE uint8_t* memlz__encode_round32(const uint8_t* src, uint8_t* dst, uint16_t* round_flags, uint32_t* hash32, size_t bits) {
+    uint16_t flags = 0;
+    MEMLZ__ENCODE_ROUND(memlz__hash32, hash32, uint32_t, bits)
+    *round_flags = flags;
+    return dst;
+}
+
+// The compressor returns 0 if the output would be larger than capacity, see memlz_compress_bounded()
+//
+// Advancing several independent streams in lockstep, one round each, with the table entries of each
+// stream's next round prefetched while the others run, was measured at 2-11% slower than compressing
+// the streams one after another (8 JSON streams, 64 KB packets, default tables, 2 MB L2). A round
+// already issues 16 independent lookups and the 768 KB of default tables fit in L2, so there is
+// little memory latency left to hide, while keeping the loop variables in memory between turns costs
+// registers. Prefetching within a single stream did not help either. There is therefore no
+// multi-stream entry point, and this function keeps its loop in one piece.
+static MEMLZ__INLINE size_t memlz__compress(void* MEMLZ__RESTRICT destination, size_t capacity, const memlz_iovec* segments, size_t count, memlz_state* state, const int kernel) {
+    (void)kernel;
+    if (state->reset != 'Y') {
+        return 0;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        len += segments[i].iov_len;
+    }
+
+    memlz__input in;
+    in.iov = segments;
+    in.count = count;
+    in.cursor.seg = 0;
+    in.cursor.pos = 0;
+    in.filter = state->filter;
+    in.stride = state->stride;
+    in.filtered_pos = 0;
+    in.filtered_len = 0;
+    const uint8_t* end;
+    const uint8_t* window = memlz__window(&in, 0, len, &end, kernel);
+    size_t window_pos = 0;
+
+    const size_t max = memlz_max_compressed_len(len) > len ? memlz_max_compressed_len(len) : len;
+    const size_t header_len = memlz__fields * memlz__fit(max);
+    size_t missing = len;
+    const uint8_t* src = window;
+    uint8_t* dst = (uint8_t*)destination;
+    uint16_t flags = 0;
+    uint64_t* hash64 = memlz__hash64_table(state);
+    uint32_t* hash32 = memlz__hash32_table(state);
+    const size_t bits = state->bits;
+    dst += header_len;
+    dst = memlz__write_options(dst, state);
+    uint8_t* checksum = state->checksum ? dst - sizeof(uint64_t) : 0;
+    const uint8_t* summed = src;
+    memlz__sum sum;
+    memlz__sum_init(&sum);
+
+    const size_t base = (size_t)(dst - (uint8_t*)destination);
+    size_t bail_at = capacity == (size_t)-1 ? capacity : 0;
+    if (capacity < memlz_header_len() || capacity < base + 3) {
+        return 0;
+    }
+    memlz__warm(state);
+
+    // The index is sized for the pages of the packet. Without memory the packet is just
+    // compressed without it
+    const uint8_t* data = 0;
+    uint64_t* pages = 0;
+    size_t page_bits = 1;
+    size_t page = 0;        // Position of the next page to look up, or of a page equal to an earlier one
+    size_t match = 0;       // Distance back to that earlier page, or 0
+    if (state->long_range && count == 1 && !in.filter && len >= 2 * MEMLZ__PAGE && (uint64_t)len / MEMLZ__PAGE < 0xffffffffull) {
+        while (page_bits < MEMLZ__PAGE_BITS && ((size_t)1 << page_bits) < len / MEMLZ__PAGE) {
+            page_bits++;
+        }
+        pages = (uint64_t*)calloc((size_t)1 << page_bits, sizeof(uint64_t));
+        data = (const uint8_t*)segments[0].iov_base;
+    }
+
+    // Move to the window at the current position, where the checksum continues
+#define MEMLZ__NEXT_WINDOW() { \
+        if (checksum && in.filter) { \
+            memlz__sum_update(&sum, summed, (size_t)(src - summed), kernel); \
+        } \
+        else if (checksum) { \
+            memlz__input_sum(&in, &sum, window_pos + (size_t)(summed - window), len - missing, kernel); \
+        } \
+        window_pos = len - missing; \
+        window = memlz__window(&in, window_pos, missing, &end, kernel); \
+        src = window; \
+        summed = window; \
+    }
+
+    for(;;) {
+        if ((size_t)(end - src) < MEMLZ__MIN(MEMLZ__LOOKAHEAD, missing)) {
+            MEMLZ__NEXT_WINDOW()
+        }
+
+        if (checksum && src - summed >= MEMLZ__SUM_CHUNK) {
+            memlz__sum_update(&sum, summed, (size_t)(src - summed), kernel);
+            summed = src;
+        }
+
+            // Compress 8-byte words, then 4-byte words and compare ratios and select best.
+            // TODO: Occurences of RLE or incompressible blocks wil disturb the result.
+            MEMLZ__STAT(const size_t wordlen = state->wordlen);
+            state->mod++;
+            if (state->mod == MEMLZ__PROBELEN / 128) {
+                state->cs8 = (state->total_output + (dst - (uint8_t*)destination)) - state->cs8;
+                state->cs4 = (state->total_output + (dst - (uint8_t*)destination));
+                state->wordlen = 4;
+            }
+            else if (state->mod == 3 * MEMLZ__PROBELEN / 128) {
+                state->cs4 = state->total_output + (dst - (uint8_t*)destination) - state->cs4;
+                if (state->cs8 < state->cs4) {
+                    state->wordlen = 8;
+                }
+            }
+            else if (state->mod == (MEMLZ__BLOCKLEN + MEMLZ__PROBELEN) / 128) {
+                state->wordlen = 8;
+                state->mod = 0;
+                state->cs8 = state->total_output + (dst - (uint8_t*)destination);
+                state->cs4 = 0;
+            }
+            MEMLZ__STAT(state->stats.wordlen_switches += wordlen != state->wordlen);
+
+        if ((size_t)(dst - (uint8_t*)destination) > bail_at) {
+            // The next iteration writes at most 3 bytes more than it reads, or than the rest
+            // of the input at the end. Uncompressed blocks are checked by themselves
+            const size_t out = (size_t)(dst - (uint8_t*)destination);
+            const size_t allowed = base + MEMLZ__BAIL_TOLERANCE + (len ? (size_t)((double)(capacity - base) * (double)(len - missing) / (double)len) : 0);
+            const size_t next = MEMLZ__MIN(16 * sizeof(uint64_t), missing) + 3;
+            if (out + next > capacity || out > allowed) {
+                free(pages);
+                return 0;
+            }
+            bail_at = MEMLZ__MIN(allowed, capacity - MEMLZ__MIN(capacity, 16 * sizeof(uint64_t) + 3));
+        }
+
+        if (pages) {
+            // Look up the next page when a round and an uncompressed block could reach it. If it
+            // equals an earlier page, the blocks before it stop at it, so that it can be encoded
+            // as a reference. Runs can go past it. The samples of the page after it are
+            // prefetched, because they are a page ahead of what is in the cache
+            const size_t pos = len - missing;
+            if (!match && page < pos) {
+                page = (pos + MEMLZ__PAGE - 1) & ~(size_t)(MEMLZ__PAGE - 1);
+            }
+            if (!match && page < pos + MEMLZ__LOOKAHEAD) {
+                if (page > len - MEMLZ__PAGE) {
+                    page = (size_t)-1;
+                }
+                else {
+                    match = memlz__page_match(pages, page_bits, data, page);
+                    if (page + 2 * MEMLZ__PAGE <= len) {
+                        memlz__page_prefetch(data + page + MEMLZ__PAGE);
+                    }
+                    page += match ? 0 : MEMLZ__PAGE;
+                }
+            }
+            if (match && pos == page) {
+                size_t n = MEMLZ__PAGE;
+                while (n <= len - page - MEMLZ__PAGE && !memcmp(data + page + n - match, data + page + n, MEMLZ__PAGE)) {
+                    n += MEMLZ__PAGE;
+                }
+                *dst++ = MEMLZ__PAGES;
+                memlz__write(dst, match, memlz__fit(match));
+                dst += memlz__fit(match);
+                memlz__write(dst, n, memlz__fit(n));
+                dst += memlz__fit(n);
+                src += n;
+                missing -= n;
+                page += n;
+                match = 0;
+                MEMLZ__STAT(state->stats.page_blocks++);
+                MEMLZ__STAT(state->stats.page_bytes += n);
+                continue;
+            }
+        }
+
+#ifdef MEMLZ__DO_RLE
+        {
+            // Most rounds do not begin with a run, so only call the kernel when they might
+            MEMLZ__TIMER(t);
+            size_t e = sizeof(uint64_t);
+            if (missing >= 2 * sizeof(uint64_t) && ((uint64_t*)src)[1] == *(uint64_t*)src) {
+                const size_t words = MEMLZ__MIN(missing, (size_t)(end - src)) / sizeof(uint64_t);
+                e = MEMLZ__RLE_WORDS(kernel, src, words) * sizeof(uint64_t);
+                if (e == words * sizeof(uint64_t) && missing - e >= sizeof(uint64_t) && !in.filter) {
+                    e += memlz__input_rle(&in, len - missing + e, *(uint64_t*)src, (missing - e) / sizeof(uint64_t), kernel) * sizeof(uint64_t);
+                }
+            }
+            e = match ? MEMLZ__MIN(e, page - (len - missing)) : e;
+            if (e >= MEMLZ__MIN_RLE) {
+                *dst++ = MEMLZ__RLE;
+                size_t length = memlz__fit(e);
+                memlz__write(dst, e, length);
+                *(uint64_t*)(dst + length) = *(uint64_t*)src;
+                dst += sizeof(uint64_t) + length;
+                missing -= e;
+                if (e > (size_t)(end - src)) {
+                    MEMLZ__NEXT_WINDOW()
+                }
+                else {
+                    src += e;
+                }
+                MEMLZ__STAT(state->stats.rle_blocks++);
+                MEMLZ__STAT(state->stats.rle_bytes += e);
+                MEMLZ__TIMER_ADD(rle_cycles, t);
+                continue;
+            }
+            MEMLZ__TIMER_ADD(rle_cycles, t);
+        }
+#endif
+        if (match && page - (len - missing) < 16 * state->wordlen) {
+            // A round would go past the page, so store the bytes before it instead
+            MEMLZ__TIMER(t);
+            const size_t u = page - (len - missing);
+            *dst++ = MEMLZ__UNCOMPRESSED;
+            memlz__write(dst, u, memlz__fit(u));
+            dst += memlz__fit(u);
+            memcpy(dst, src, u);
+            dst += u;
+            src += u;
+            missing -= u;
+            MEMLZ__STAT(state->stats.uncompressed_blocks++);
+            MEMLZ__STAT(state->stats.uncompressed_bytes += u);
+            MEMLZ__TIMER_ADD(uncompressed_cycles, t);
+            continue;
+        }
+        {
+            MEMLZ__TIMER(t);
+            *dst++ = state->wordlen == 8 ? MEMLZ__NORMAL64 : MEMLZ__NORMAL32;
+            MEMLZ__STAT(*(state->wordlen == 8 ? &state->stats.normal64_blocks : &state->stats.normal32_blocks) += 1);
+            if (missing < 16 * state->wordlen) {
+                MEMLZ__STAT(*(state->wordlen == 8 ? &state->stats.normal64_bytes : &state->stats.normal32_bytes) += missing);
+                break;
+            }
+
+            uint16_t* flags_ptr = (uint16_t*)dst;
+            dst += 2;
+
+            if (state->wordlen == 8 && MEMLZ__ROUND64(src, &dst, hash64, bits, &flags)) {
+                src += 16 * sizeof(uint64_t);
+            }
+            else if (state->wordlen == 8 && bits == MEMLZ__MAX_BITS) {
+                MEMLZ__ENCODE_ROUND(memlz__hash64, hash64, uint64_t, MEMLZ__MAX_BITS)
+            }
+            else if (state->wordlen == 8) {
+                dst = memlz__encode_round64(src, dst, &flags, hash64, bits);
+                src += 16 * sizeof(uint64_t);
+            }
+            else if (MEMLZ__ROUND32(src, &dst, hash32, bits, &flags)) {
+                src += 16 * sizeof(uint32_t);
+            }
+            else if (bits == MEMLZ__MAX_BITS) {
+                MEMLZ__ENCODE_ROUND(memlz__hash32, hash32, uint32_t, MEMLZ__MAX_BITS)
+            }
+            else {
+                dst = memlz__encode_round32(src, dst, &flags, hash32, bits);
+                src += 16 * sizeof(uint32_t);
+            }
+
+            *flags_ptr = (uint16_t)flags;
+            missing -= 16 * state->wordlen;
+            MEMLZ__STAT(*(state->wordlen == 8 ? &state->stats.normal64_bytes : &state->stats.normal32_bytes) += 16 * state->wordlen);
+            MEMLZ__STAT(state->stats.hits += memlz__popcount16(flags));
+            MEMLZ__STAT(state->stats.misses += 16 - memlz__popcount16(flags));
+            MEMLZ__TIMER_ADD(normal_cycles, t);
+        }
+
+#ifdef MEMLZ__DO_INCOMPRESSIBLE
+        {
+            // Uncompressed blocks stop before runs, which are then encoded as RLE blocks
+            state->incompressible = flags ? 0 : state->incompressible + 1;
+            size_t u = memlz__incompressible_len(state->incompressible, missing);
+            if (u > 0 && (!match || page > len - missing)) {
+                MEMLZ__TIMER(t);
+                u = match ? MEMLZ__MIN(u, page - (len - missing)) : u;
+                u = memlz__store_len(src, u, kernel);
+                if (u > 0) {
+                    if (capacity - (size_t)(dst - (uint8_t*)destination) < u + 4) {
+                        free(pages);
+                        return 0;
+                    }
+                    *dst++ = MEMLZ__UNCOMPRESSED;
+                    memlz__write(dst, u, memlz__fit(u));
+                    dst += memlz__fit(u);
+                    for (size_t n = 0; n < u / sizeof(uint64_t); n++) {
+                        ((uint64_t*)dst)[n] = ((uint64_t*)src)[n];
+                    }
+                    dst += u;
+                    src += u;
+                    missing -= u;
+                    MEMLZ__STAT(state->stats.uncompressed_blocks++);
+                    MEMLZ__STAT(state->stats.uncompressed_bytes += u);
+                }
+                MEMLZ__TIMER_ADD(uncompressed_cycles, t);
+            }
+        }
+#endif
+    }
+  
+    if (missing >= state->wordlen) {
+        uint16_t* flag_ptr = (uint16_t*)dst;
+        dst += 2;
+        flags = 0;
+        int flags_left = memlz__words_per_round;
+
+        while (missing >= state->wordlen) {
+
+            if (state->wordlen == 8) {
+                uint64_t a = memlz__hash64(*(uint64_t*)src, bits);
+                MEMLZ__ENCODE_WORD(hash64, uint64_t, a, 0, )
+            }
+            else {
+                uint32_t a = memlz__hash32(*(uint32_t*)src, bits);
+                MEMLZ__ENCODE_WORD(hash32, uint32_t, a, 0, )
+            }
+
+            src += state->wordlen;
+            flags_left--;
+            missing -= state->wordlen;
+        }
+
+        flags <<= flags_left;
+        *flag_ptr = flags;
+        MEMLZ__STAT(state->stats.hits += memlz__popcount16(flags));
+        MEMLZ__STAT(state->stats.misses += memlz__words_per_round - flags_left - memlz__popcount16(flags));
+    }
+
+    size_t tail_count = missing;
+    memcpy(dst, src, tail_count);
+    dst += tail_count;
+
+    if (checksum) {
+        const uint64_t h = memlz__sum_final(&sum, summed, (size_t)(src + tail_count - summed), kernel);
+        memcpy(checksum, &h, sizeof(h));
+    }
+
+    size_t compressed_len = (size_t)(dst - (uint8_t*)destination);
+    if (compressed_len < memlz_header_len()) {
+        memset(dst, 'M', memlz_header_len() - compressed_len);
+        compressed_len = memlz_header_len();
+    }
+
+    memlz__write(destination, len, header_len / memlz__fields);
+    memlz__write((uint8_t*)destination + header_len / memlz__fields, compressed_len, header_len / memlz__fields);
+
+    state->total_input += len;
+    state->total_output += compressed_len;
+
+    free(pages);
+    return compressed_len;
+}
+
+#ifdef MEMLZ__X86
+MEMLZ__TARGET("avx512f,avx512dq,avx512cd,avx2,bmi2") static size_t memlz__compress_avx512(void* MEMLZ__RESTRICT destination, size_t capacity, const memlz_iovec* segments, size_t count, memlz_state* state) {
+    return memlz__compress(destination, capacity, segments, count, state, MEMLZ_KERNEL_AVX512);
+}
+
+MEMLZ__TARGET("avx2,bmi2") static size_t memlz__compress_avx2(void* MEMLZ__RESTRICT destination, size_t capacity, const memlz_iovec* segments, size_t count, memlz_state* state) {
+    return memlz__compress(destination, capacity, segments, count, state, MEMLZ_KERNEL_AVX2);
+}
+
+MEMLZ__TARGET("sse4.2,popcnt") static size_t memlz__compress_sse42(void* MEMLZ__RESTRICT destination, size_t capacity, const memlz_iovec* segments, size_t count, memlz_state* state) {
+    return memlz__compress(destination, capacity, segments, count, state, MEMLZ_KERNEL_SSE42);
+}
+#endif
+
+static size_t memlz__stream_compress(void* MEMLZ__RESTRICT destination, size_t capacity, const memlz_iovec* segments, size_t count, memlz_state* state) {
+    const int kernel = memlz__selected_kernel();
+#ifdef MEMLZ__X86
+    if (kernel == MEMLZ_KERNEL_AVX512) {
+        return memlz__compress_avx512(destination, capacity, segments, count, state);
+    }
+    if (kernel == MEMLZ_KERNEL_AVX2) {
+        return memlz__compress_avx2(destination, capacity, segments, count, state);
+    }
+    if (kernel == MEMLZ_KERNEL_SSE42) {
+        return memlz__compress_sse42(destination, capacity, segments, count, state);
+    }
+#endif
+#ifdef MEMLZ__NEON
+    if (kernel == MEMLZ_KERNEL_NEON) {
+        return memlz__compress(destination, capacity, segments, count, state, MEMLZ_KERNEL_NEON);
+    }
+#endif
+    (void)kernel;
+    return memlz__compress(destination, capacity, segments, count, state, MEMLZ_KERNEL_SCALAR);
+}
+
+static size_t memlz_stream_compressv(void* MEMLZ__RESTRICT destination, const memlz_iovec* segments, size_t count, memlz_state* state) {
+    return memlz__stream_compress(destination, (size_t)-1, segments, count, state);
+}
+
+static size_t memlz_stream_compress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, memlz_state* state) {
+    memlz_iovec segment;
+    segment.iov_base = (void*)source;
+    segment.iov_len = len;
+    return memlz_stream_compressv(destination, &segment, 1, state);
+}
+
+static size_t memlz_decompressed_len(const void* src) {
+    return memlz__read(src);
+}
+
+static size_t memlz_compressed_len(const void* src) {
+    size_t header_field_len = memlz__bytes(src);
+    return memlz__read((uint8_t*)src + header_field_len);
+}
+
+// Fill n bytes with repeats of the word v. A run of one byte value goes to memset(), which
+// uses the widest stores of the CPU and non-temporal stores for runs larger than the cache
+static void memlz__fill(uint8_t* dst, uint64_t v, size_t n) {
+    if (v == (v & 0xff) * 0x0101010101010101ull) {
+        memset(dst, (int)(v & 0xff), n);
+        return;
+    }
+    for (size_t i = 0; i < n / sizeof(uint64_t); i++) {
+        memcpy(dst + i * sizeof(uint64_t), &v, sizeof(uint64_t));
+    }
+    memcpy(dst + (n & ~(sizeof(uint64_t) - 1)), &v, n & (sizeof(uint64_t) - 1));
+}
+
+// Copy n bytes from distance bytes back in the output, in pieces that do not overlap
+static void memlz__copy_back(uint8_t* dst, size_t distance, size_t n) {
+    for (size_t done = 0; done < n; done += distance) {
+        memcpy(dst + done, dst + done - distance, MEMLZ__MIN(distance, n - done));
+    }
+}
+
+// A page reference is valid if it copies whole pages from earlier output of the packet. The
+// compressor never emits one together with a filter
+static int memlz__valid_pages(uint64_t distance, uint64_t n, size_t written, const memlz__options* options) {
+    return !options->filter && distance > 0 && distance <= written && distance % MEMLZ__PAGE == 0 && n > 0 && n % MEMLZ__PAGE == 0;
+}
+
+#define MEMLZ__R(p, l) do { if ((p) < r1 || (p) > r2 || (l) > (size_t)((r2) - (p))) return 0; } while (0)
+#define MEMLZ__W(p, l) do { if ((p) < w1 || (p) > w2 || (l) > (size_t)((w2) - (p))) return 0; } while (0)
+#define MEMLZ__R0(p, l)
+#define MEMLZ__R1(p, l) MEMLZ__R(p, l)
+
+// Each word branches on its flag. Decoding 8 flags at a time without branches, from tables with
+// the offset of each word, was about 10% faster on binary data where hits look random, but 15%
+// slower on source code, whose flags the CPU predicts well, and slower on JSON on some CPUs.
+// Choosing between the two per round by how often the flags change did not beat either. Splitting
+// rounds into lanes with their own flags, data and part of the table was slower too, and costs
+// ratio because words can only match words of the same lane
+#define MEMLZ__DECODE_WORD(safe, h, tbl, typ, hb, next) \
+        if (flags & 0b1000000000000000) { \
+            MEMLZ__R##safe(src, 2); \
+            word = tbl[*(uint16_t*)src & ((1u << (hb)) - 1)]; \
+            src += 2; \
+            *(typ*)dst = word; \
+            dst += sizeof(typ); \
+            flags = (uint16_t)(flags << 1); \
+            next; \
+        } else { \
+            MEMLZ__R##safe(src, sizeof(typ)); \
+            word = *((const typ*)src); \
+            src += sizeof(typ); \
+            tbl[h(word, hb)] = word; \
+            *(typ*)dst = word; \
+            dst += sizeof(typ); \
+            flags = (uint16_t)(flags << 1); \
+            next; \
+        } 
+
+
+#define MEMLZ__DECODE4(safe, h, tbl, typ, hb) MEMLZ__DECODE_WORD \
+                    (safe, h, tbl, typ, hb, MEMLZ__DECODE_WORD \
+                    (safe, h, tbl, typ, hb, MEMLZ__DECODE_WORD \
+                    (safe, h, tbl, typ, hb, MEMLZ__DECODE_WORD \
+                    (safe, h, tbl, typ, hb, ))))
+
+// Decode a round with a table size other than the default. It is kept out of the loop, which then
+// only has the code for the default size and runs faster. Returns the end of the round
+static MEMLZ__NOINLINE const uint8_t* memlz__decode_round64(const uint8_t* src, uint8_t* dst, uint16_t flags, uint64_t* hash64, size_t bits) {
+    uint64_t word;
+    MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash64, hash64, uint64_t, bits))
+    return src;
+}
+
+static MEMLZ__NOINLINE const uint8_t* memlz__decode_round32(const uint8_t* src, uint8_t* dst, uint16_t flags, uint32_t* hash32, size_t bits) {
+    uint32_t word;
+    MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash32, hash32, uint32_t, bits))
+    return src;
+}
+
+static size_t memlz__decompress(void* destination, const void* source, memlz_state* state, const int kernel) {
+    if (state->reset != 'Y') {
+        return 0;
+    }
+
+    const size_t decompressed_len = memlz_decompressed_len(source);
+    const size_t compressed_len = memlz_compressed_len(source);
+
+    if (compressed_len > memlz_max_compressed_len(decompressed_len)) {
+        return 0;
+    }
+
+    // For memory safe decompression
+    const uint8_t* r1 = (uint8_t*)source;
+    const uint8_t* r2 = (uint8_t*)source + compressed_len;
+    const uint8_t* w1 = (uint8_t*)destination;
+    const uint8_t* w2 = (uint8_t*)destination + decompressed_len;
+
+    size_t header_length = memlz__bytes(source) * memlz__fields;
+    const uint8_t* src = (const uint8_t*)source + header_length;
+    uint8_t* dst = (uint8_t*)destination;
+
+    memlz__options options;
+    src = memlz__read_options(src, r2, &options);
+    if (!src || options.bits != state->bits || options.dict_id != state->dict_id || !memlz__resume(state, options.flags)) {
+        return 0;
+    }
+
+    uint64_t* hash64 = memlz__hash64_table(state);
+    uint32_t* hash32 = memlz__hash32_table(state);
+    const size_t bits = state->bits;
+
+    size_t missing = decompressed_len;
+    size_t last_missing = 0;
+    const uint8_t* summed = dst;
+    memlz__sum sum;
+    memlz__sum_init(&sum);
+    const size_t filter_block = options.filter ? memlz__filter_block_len(options.stride) : 0;
+    size_t unfiltered = 0;
+
+    uint8_t blocktype = 0;
+    size_t memlz__wordlen = 0;
+
+    // Copied to locals so that packets without a checksum or filter test a register per round
+    const unsigned checksum = options.flags & MEMLZ__OPT_CHECKSUM;
+    const unsigned filter = options.filter;
+
+    for (;;) {
+        if (checksum | filter) {
+            if (checksum && dst - summed >= MEMLZ__SUM_CHUNK) {
+                memlz__sum_update(&sum, summed, (size_t)(dst - summed), kernel);
+                summed = dst;
+            }
+
+            // The checksum is of the filtered data, so the filter is reversed behind it
+            if (filter) {
+                const size_t ready = (size_t)((checksum ? summed : dst) - w1);
+                if (ready - unfiltered >= filter_block) {
+                    memlz__unfilter((uint8_t*)destination, unfiltered, ready - ready % filter_block, filter, options.stride, kernel);
+                    unfiltered = ready - ready % filter_block;
+                }
+            }
+        }
+
+        // Prevent infinite loops or slow advance 
+        const size_t min_advance = MEMLZ__MIN(64, MEMLZ__MIN(MEMLZ__INCOMPRESSIBLE_ADVANCE, MEMLZ__MIN_RLE));
+        if (last_missing != 0 && missing > last_missing + min_advance) {
+            return 0;
+        }
+        last_missing = missing;
+
+        MEMLZ__R(src, 1);
+        blocktype = *(uint8_t*)src++;
+
+#ifdef MEMLZ__DO_INCOMPRESSIBLE
+        if (blocktype == MEMLZ__UNCOMPRESSED) {
+            MEMLZ__R(src, 1);
+            size_t len = memlz__bytes(src);
+            MEMLZ__R(src, len);
+            size_t unc = memlz__read(src);
+            src += len;
+            MEMLZ__R(src, unc);
+            MEMLZ__W(dst, unc);
+            memmove(dst, src, unc);
+            src += unc;
+            dst += unc;
+            missing -= unc;
+            continue;
+        }
+#endif
+
+#ifdef MEMLZ__DO_RLE
+        if (blocktype == MEMLZ__RLE) {
+            MEMLZ__R(src, 1);
+            size_t len = memlz__bytes(src);
+            MEMLZ__R(src, len);
+            uint64_t z = memlz__read(src);
+            src += len;
+            MEMLZ__R(src, sizeof(uint64_t));
+            uint64_t v = *((uint64_t*)src);
+            src += sizeof(uint64_t);
+            MEMLZ__W(dst, z);
+            memlz__fill(dst, v, (size_t)z);
+            dst += z;
+            missing -= z;
+            continue;
+        }
+#endif
+
+        if (blocktype == MEMLZ__PAGES) {
+            MEMLZ__R(src, 1);
+            size_t len = memlz__bytes(src);
+            MEMLZ__R(src, len + 1);
+            uint64_t distance = memlz__read(src);
+            src += len;
+            len = memlz__bytes(src);
+            MEMLZ__R(src, len);
+            uint64_t n = memlz__read(src);
+            src += len;
+            if (!memlz__valid_pages(distance, n, (size_t)(dst - w1), &options)) {
+                return 0;
+            }
+            MEMLZ__W(dst, n);
+            memlz__copy_back(dst, (size_t)distance, (size_t)n);
+            dst += n;
+            missing -= n;
+            continue;
+        }
+
+        if (blocktype == MEMLZ__NORMAL64) {
+            memlz__wordlen = 8;
+        }
+        else if (blocktype == MEMLZ__NORMAL32) {
+            memlz__wordlen = 4;
+        }
+        else {
+            return 0;
+        }
+
+        if (missing < memlz__wordlen * 16) {
+            break;
+        }
+
+        MEMLZ__R(src, 2);
+        uint16_t flags = *(uint16_t*)src;
+        src += 2;
+
+        if (src + 16 * sizeof(uint64_t) < r2) {
+            // A round takes up at most 16 words, so all reads stay inside it. The default table
+            // size gets its own copy of the code because a constant shift in the hash function
+            // is faster than a variable one on x86 without BMI2, and the mask of a reference
+            // then disappears
+            if (blocktype == MEMLZ__NORMAL64) {
+                uint64_t word;
+                MEMLZ__W(dst, 16 * sizeof(word));
+                if (bits == MEMLZ__MAX_BITS) {
+                    MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash64, hash64, uint64_t, MEMLZ__MAX_BITS))
+                }
+                else {
+                    src = memlz__decode_round64(src, dst, flags, hash64, bits);
+                    dst += 16 * sizeof(word);
+                }
+                missing -= 16 * sizeof(uint64_t);
+            }
+            else {
+                uint32_t word;
+                MEMLZ__W(dst, 16 * sizeof(word));
+                if (bits == MEMLZ__MAX_BITS) {
+                    MEMLZ__UNROLL4(MEMLZ__DECODE4(0, memlz__hash32, hash32, uint32_t, MEMLZ__MAX_BITS))
+                }
+                else {
+                    src = memlz__decode_round32(src, dst, flags, hash32, bits);
+                    dst += 16 * sizeof(word);
+                }
+                missing -= 16 * sizeof(uint32_t);
+            }
+        }
+        else {
+            if (blocktype == MEMLZ__NORMAL64) {
+                uint64_t word;
+                MEMLZ__W(dst, 16 * sizeof(word));
+                MEMLZ__UNROLL4(MEMLZ__DECODE4(1, memlz__hash64, hash64, uint64_t, bits))
+                missing -= 16 * sizeof(uint64_t);
+            }
+            else {
+                uint32_t word;
+                MEMLZ__W(dst, 16 * sizeof(word));
+                MEMLZ__UNROLL4(MEMLZ__DECODE4(1, memlz__hash32, hash32, uint32_t, bits))
+                missing -= 16 * sizeof(uint32_t);
+            }
+        }
+    }
+    if (missing >= memlz__wordlen) {
+        MEMLZ__R(src, 2);
+        uint16_t flags = *(uint16_t*)src;
+        src += 2;
+
+        while (missing >= memlz__wordlen) {
+            if (memlz__wordlen == 8) {
+                uint64_t word;
+                MEMLZ__W(dst, sizeof(word));
+                MEMLZ__DECODE_WORD(1, memlz__hash64, hash64, uint64_t, bits,)
+            }
+            else {
+                uint32_t word;
+                MEMLZ__W(dst, sizeof(word));
+                MEMLZ__DECODE_WORD(1, memlz__hash32, hash32, uint32_t, bits,)
+            }
+            missing -= memlz__wordlen;
+        }
+    }
+
+    size_t tail_count = missing;
+    MEMLZ__R(src, tail_count);
+    MEMLZ__W(dst, tail_count);
+    memmove(dst, src, tail_count);
+
+    if ((options.flags & MEMLZ__OPT_CHECKSUM) && memlz__sum_final(&sum, summed, (size_t)(dst + tail_count - summed), kernel) != options.checksum) {
+        return 0;
+    }
+    if (options.filter) {
+        memlz__unfilter((uint8_t*)destination, unfiltered, decompressed_len, options.filter, options.stride, kernel);
+    }
+
+    state->total_input += compressed_len;
+    state->total_output += decompressed_len;
+    return decompressed_len;
+}
+
+// Not restrict because memlz_stream_decompress_in_place() lets destination overlap source. The
+// kernel only selects the checksum and filter code, which check it themselves
+static size_t memlz__stream_decompress(void* destination, const void* source, memlz_state* state) {
+    return memlz__decompress(destination, source, state, memlz__selected_kernel());
+}
+
+static size_t memlz_stream_decompress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, memlz_state* state) {
+    return memlz__stream_decompress(destination, source, state);
+}
+
+// The decompressor writes each block after reading it, so data that is decompressed in place
+// stays intact if the output of each block ends before the input of the block starts, which
+// is the case if the buffer has room for the largest block and for the largest growth of the
+// blocks that remain. That is the growth of memlz_max_compressed_len() because it holds for
+// any part of the data. Uncompressed blocks are copied with memmove() and need no room.
+MEMLZ__UNUSED static size_t memlz_in_place_margin(size_t decompressed_len) {
+    return memlz_max_compressed_len(decompressed_len) - decompressed_len + MEMLZ__MAX_BLOCK_INPUT;
+}
+
+MEMLZ__UNUSED static size_t memlz_stream_decompress_in_place(void* destination, const void* source, memlz_state* state) {
+    const uint8_t* end = (const uint8_t*)source + memlz_compressed_len(source);
+    if ((const uint8_t*)source < (uint8_t*)destination || (size_t)(end - (uint8_t*)destination) < memlz_decompressed_len(source) + memlz_in_place_margin(memlz_decompressed_len(source))) {
+        return 0;
+    }
+    return memlz__stream_decompress(destination, source, state);
+}
+
+#define MEMLZ__DEC_HEADER 0
+#define MEMLZ__DEC_OPTIONS 1
+#define MEMLZ__DEC_BLOCKS 2
+#define MEMLZ__DEC_END 3
+
+MEMLZ__UNUSED static void memlz_decoder_begin(memlz_decoder* decoder, memlz_state* state, void* destination, size_t capacity) {
+    memset(decoder, 0, offsetof(memlz_decoder, buf));
+    decoder->state = state;
+    decoder->dst = (uint8_t*)destination;
+    decoder->capacity = capacity;
+    decoder->phase = MEMLZ__DEC_HEADER;
+    decoder->status = state->reset == 'Y' ? MEMLZ_DECODER_MORE : MEMLZ_DECODER_ERROR;
+    memlz__sum_init(&decoder->sum);
+}
+
+MEMLZ__UNUSED static size_t memlz_decoder_ready(const memlz_decoder* decoder) {
+    return decoder->written;
+}
+
+// Returns the length of the unit that begins with the n bytes at p, or a lower bound that is
+// larger than n if the bytes so far do not tell
+static size_t memlz__unit_len(const memlz_decoder* d, const uint8_t* p, size_t n) {
+    if (d->phase == MEMLZ__DEC_HEADER) {
+        return memlz__bytes(p) * memlz__fields;
+    }
+    if (d->phase == MEMLZ__DEC_OPTIONS) {
+        return n < 2 ? 2 : 2 + ((p[1] & MEMLZ__OPT_BITS) ? 1 : 0) + ((p[1] & MEMLZ__OPT_DICT) ? sizeof(uint32_t) : 0)
+            + ((p[1] & MEMLZ__OPT_FILTER) ? 2 : 0) + ((p[1] & MEMLZ__OPT_CHECKSUM) ? sizeof(uint64_t) : 0);
+    }
+    if (p[0] == MEMLZ__UNCOMPRESSED) {
+        return n < 2 ? 2 : 1 + memlz__bytes(p + 1);
+    }
+    if (p[0] == MEMLZ__RLE) {
+        return n < 2 ? 2 : 1 + memlz__bytes(p + 1) + sizeof(uint64_t);
+    }
+    if (p[0] == MEMLZ__PAGES) {
+        return n < 2 ? 2 : n < 2 + memlz__bytes(p + 1) ? 2 + memlz__bytes(p + 1) : 1 + memlz__bytes(p + 1) + memlz__bytes(p + 1 + memlz__bytes(p + 1));
+    }
+    if (p[0] == MEMLZ__NORMAL64 || p[0] == MEMLZ__NORMAL32) {
+        const size_t wordlen = p[0] == MEMLZ__NORMAL64 ? 8 : 4;
+        const size_t words = d->missing >= 16 * wordlen ? 16 : d->missing / wordlen;
+        const size_t tail = d->missing >= 16 * wordlen ? 0 : d->missing % wordlen;
+        if (words == 0) {
+            return 1 + tail;
+        }
+        if (n < 3) {
+            return 3;
+        }
+        const size_t refs = memlz__popcount16(*(const uint16_t*)(p + 1) >> (16 - words));
+        return 3 + 2 * refs + wordlen * (words - refs) + tail;
+    }
+    // Other block types are malformed, which memlz__decode_unit() reports
+    return 1;
+}
+
+// Decode a complete unit. Returns 0 if it is malformed
+static int memlz__decode_unit(memlz_decoder* d, const uint8_t* src, size_t len) {
+    memlz_state* state = d->state;
+
+    if (d->phase == MEMLZ__DEC_HEADER) {
+        d->decompressed_len = memlz__read(src);
+        d->compressed_len = memlz__read(src + len / memlz__fields);
+        d->missing = d->decompressed_len;
+        d->phase = MEMLZ__DEC_OPTIONS;
+        return d->compressed_len <= memlz_max_compressed_len(d->decompressed_len) && d->compressed_len >= len && d->decompressed_len <= d->capacity;
+    }
+
+    if (d->phase == MEMLZ__DEC_OPTIONS) {
+        d->phase = MEMLZ__DEC_BLOCKS;
+        return memlz__read_options(src, src + len, &d->options) == src + len && d->options.bits == state->bits && d->options.dict_id == state->dict_id
+            && memlz__resume(state, d->options.flags);
+    }
+
+    uint8_t* dst = d->dst + d->written;
+    if ((d->options.flags & MEMLZ__OPT_CHECKSUM) && d->written - d->summed >= MEMLZ__SUM_CHUNK) {
+        memlz__sum_update(&d->sum, d->dst + d->summed, d->written - d->summed, memlz__selected_kernel());
+        d->summed = d->written;
+    }
+    if (d->options.filter) {
+        const size_t block = memlz__filter_block_len(d->options.stride);
+        const size_t ready = d->options.flags & MEMLZ__OPT_CHECKSUM ? d->summed : d->written;
+        if (ready - d->unfiltered >= block) {
+            memlz__unfilter(d->dst, d->unfiltered, ready - ready % block, d->options.filter, d->options.stride, memlz__selected_kernel());
+            d->unfiltered = ready - ready % block;
+        }
+    }
+
+    const uint8_t blocktype = *src++;
+    if (blocktype == MEMLZ__UNCOMPRESSED) {
+        d->copy = memlz__read(src);
+        if (d->copy > d->missing) {
+            return 0;
+        }
+        d->missing -= d->copy;
+        return 1;
+    }
+
+    if (blocktype == MEMLZ__RLE) {
+        const uint64_t z = memlz__read(src);
+        const uint64_t v = *(const uint64_t*)(src + memlz__bytes(src));
+        if (z > d->missing) {
+            return 0;
+        }
+        memlz__fill(dst, v, (size_t)z);
+        d->written += z;
+        d->missing -= z;
+        return 1;
+    }
+
+    if (blocktype == MEMLZ__PAGES) {
+        const uint64_t distance = memlz__read(src);
+        const uint64_t n = memlz__read(src + memlz__bytes(src));
+        if (!memlz__valid_pages(distance, n, d->written, &d->options) || n > d->missing) {
+            return 0;
+        }
+        memlz__copy_back(dst, (size_t)distance, (size_t)n);
+        d->written += n;
+        d->missing -= n;
+        return 1;
+    }
+
+    uint64_t* hash64 = memlz__hash64_table(state);
+    uint32_t* hash32 = memlz__hash32_table(state);
+    const size_t bits = state->bits;
+    const uint16_t mask = (uint16_t)((1u << bits) - 1);
+    if (blocktype != MEMLZ__NORMAL64 && blocktype != MEMLZ__NORMAL32) {
+        return 0;
+    }
+    const size_t wordlen = blocktype == MEMLZ__NORMAL64 ? 8 : 4;
+    const size_t words = d->missing >= 16 * wordlen ? 16 : d->missing / wordlen;
+
+    if (words > 0) {
+        uint16_t flags = *(const uint16_t*)src;
+        src += 2;
+        for (size_t i = 0; i < words; i++, flags = (uint16_t)(flags << 1)) {
+            if (wordlen == 8) {
+                uint64_t word;
+                if (flags & 0x8000) {
+                    word = hash64[*(const uint16_t*)src & mask];
+                    src += 2;
+                }
+                else {
+                    word = *(const uint64_t*)src;
+                    hash64[memlz__hash64(word, bits)] = word;
+                    src += sizeof(uint64_t);
+                }
+                ((uint64_t*)dst)[i] = word;
+            }
+            else {
+                uint32_t word;
+                if (flags & 0x8000) {
+                    word = hash32[*(const uint16_t*)src & mask];
+                    src += 2;
+                }
+                else {
+                    word = *(const uint32_t*)src;
+                    hash32[memlz__hash32(word, bits)] = word;
+                    src += sizeof(uint32_t);
+                }
+                ((uint32_t*)dst)[i] = word;
+            }
+        }
+        dst += words * wordlen;
+        d->written += words * wordlen;
+        d->missing -= words * wordlen;
+    }
+
+    // The last block of the packet ends with the bytes that do not fill a word
+    if (words < 16) {
+        memcpy(dst, src, d->missing);
+        d->written += d->missing;
+        d->missing = 0;
+        d->phase = MEMLZ__DEC_END;
+    }
+    return 1;
+}
+
+MEMLZ__UNUSED static int memlz_decoder_feed(memlz_decoder* decoder, const void* fragment, size_t len, size_t* consumed) {
+    memlz_decoder* d = decoder;
+    const uint8_t* in = (const uint8_t*)fragment;
+    const uint8_t* end = in + len;
+
+    while (d->status == MEMLZ_DECODER_MORE) {
+        // Never consume bytes of the next packet
+        size_t avail = (size_t)(end - in);
+        if (d->phase != MEMLZ__DEC_HEADER) {
+            avail = MEMLZ__MIN(avail, d->compressed_len - d->pos);
+        }
+
+        if (d->copy > 0) {
+            const size_t n = MEMLZ__MIN(avail, d->copy);
+            memcpy(d->dst + d->written, in, n);
+            in += n;
+            d->pos += n;
+            d->written += n;
+            d->copy -= n;
+            if (d->copy > 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (d->phase == MEMLZ__DEC_END) {
+            // Skip the padding of packets that are shorter than memlz_header_len()
+            in += avail;
+            d->pos += avail;
+            if (d->pos < d->compressed_len) {
+                break;
+            }
+            if ((d->options.flags & MEMLZ__OPT_CHECKSUM) &&
+                memlz__sum_final(&d->sum, d->dst + d->summed, d->written - d->summed, memlz__selected_kernel()) != d->options.checksum) {
+                d->status = MEMLZ_DECODER_ERROR;
+                break;
+            }
+            if (d->options.filter) {
+                memlz__unfilter(d->dst, d->unfiltered, d->written, d->options.filter, d->options.stride, memlz__selected_kernel());
+            }
+            d->state->total_input += d->compressed_len;
+            d->state->total_output += d->decompressed_len;
+            d->status = MEMLZ_DECODER_DONE;
+            break;
+        }
+
+        if (d->buffered == 0 && avail == 0) {
+            break;
+        }
+        if (d->phase == MEMLZ__DEC_OPTIONS && (d->buffered ? d->buf[0] : *in) != MEMLZ__OPTIONS) {
+            d->phase = MEMLZ__DEC_BLOCKS;
+            if (!memlz__resume(d->state, 0)) {
+                d->status = MEMLZ_DECODER_ERROR;
+                break;
+            }
+        }
+
+        size_t unit = d->buffered == 0 ? memlz__unit_len(d, in, avail) : 0;
+        const uint8_t* src = in;
+        if (d->buffered == 0 && unit <= avail) {
+            in += unit;
+            d->pos += unit;
+        }
+        else {
+            // Collect the unit in buf until it is complete
+            unit = d->buffered ? memlz__unit_len(d, d->buf, d->buffered) : unit;
+            while (unit > d->buffered && in < end) {
+                if (unit > sizeof(d->buf) || (d->phase != MEMLZ__DEC_HEADER && unit - d->buffered > d->compressed_len - d->pos)) {
+                    d->status = MEMLZ_DECODER_ERROR;
+                    break;
+                }
+                const size_t n = MEMLZ__MIN(unit - d->buffered, (size_t)(end - in));
+                memcpy(d->buf + d->buffered, in, n);
+                in += n;
+                d->pos += n;
+                d->buffered += n;
+                unit = memlz__unit_len(d, d->buf, d->buffered);
+            }
+            if (d->status != MEMLZ_DECODER_MORE || unit > d->buffered) {
+                break;
+            }
+            src = d->buf;
+            d->buffered = 0;
+        }
+
+        if (!memlz__decode_unit(d, src, unit)) {
+            d->status = MEMLZ_DECODER_ERROR;
+        }
+    }
+
+    if (consumed) {
+        *consumed = (size_t)(in - (const uint8_t*)fragment);
+    }
+    return d->status;
+}
+ 
+// A frame consists of an ordinary header, the MEMLZ__FRAME byte and the block length, then
+// the blocks that are each a complete packet compressed with a fresh state, and finally an
+// index with the 64-bit offset of each block measured from the start of the frame.
+
+typedef struct memlz__job {
+    uint8_t* dst;
+    const uint8_t* src;
+    size_t len;
+    size_t block_len;
+    size_t blocks;
+    size_t slot;
+    size_t pos;
+    size_t* sizes;
+    const uint8_t* index;
+    memlz_state* state;
+    size_t next;
+    size_t placed;
+    int failed;
+    int decompress;
+} memlz__job;
+
+static size_t memlz__next(memlz__job* job) {
+#if defined(MEMLZ_THREADS) && defined(_WIN32)
+    return (size_t)InterlockedExchangeAdd64((volatile LONG64*)&job->next, 1);
+#elif defined(MEMLZ_THREADS)
+    return __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#else
+    return job->next++;
+#endif
+}
+
+// Blocks that are compressed in parallel are placed in order. Returns the number of blocks that
+// are in their final place
+static size_t memlz__placed(memlz__job* job) {
+#if defined(MEMLZ_THREADS) && defined(_WIN32)
+    return (size_t)InterlockedCompareExchange64((volatile LONG64*)&job->placed, 0, 0);
+#elif defined(MEMLZ_THREADS)
+    return __atomic_load_n(&job->placed, __ATOMIC_ACQUIRE);
+#else
+    return job->placed;
+#endif
+}
+
+static void memlz__place(memlz__job* job, size_t placed) {
+#if defined(MEMLZ_THREADS) && defined(_WIN32)
+    InterlockedExchange64((volatile LONG64*)&job->placed, (LONG64)placed);
+#elif defined(MEMLZ_THREADS)
+    __atomic_store_n(&job->placed, placed, __ATOMIC_RELEASE);
+#else
+    job->placed = placed;
+#endif
+}
+
+// Let the thread that holds the block before the one a thread waits for run
+static void memlz__yield(void) {
+#if defined(MEMLZ_THREADS) && defined(_WIN32)
+    SwitchToThread();
+#elif defined(MEMLZ_THREADS)
+    sched_yield();
+#endif
+}
+
+// Any thread can report that the job failed
+static void memlz__fail(memlz__job* job) {
+#if defined(MEMLZ_THREADS) && defined(_WIN32)
+    InterlockedExchange((volatile LONG*)&job->failed, 1);
+#elif defined(MEMLZ_THREADS)
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+#else
+    job->failed = 1;
+#endif
+}
+
+static void memlz__work(memlz__job* job) {
+    memlz_state* state = job->state ? job->state : (memlz_state*)malloc(sizeof(memlz_state));
+    uint8_t* block = job->slot ? (uint8_t*)malloc(job->slot) : 0;
+    if (!state || (job->slot && !block)) {
+        // Blocks are only taken after this point, so when compressing in parallel the other
+        // threads compress the blocks of this one
+        if (!job->slot) {
+            memlz__fail(job);
+        }
+        if (!job->state) {
+            free(state);
+        }
+        free(block);
+        return;
+    }
+    if (!job->state) {
+        memlz_reset(state);
+    }
+
+    for (;;) {
+        size_t i = memlz__next(job);
+        if (i >= job->blocks) {
+            break;
+        }
+        size_t len = MEMLZ__MIN(job->block_len, job->len - i * job->block_len);
+        if (job->decompress) {
+            if (memlz_stream_decompress(job->dst + i * job->block_len, job->src + ((const uint64_t*)job->index)[i], state) != len) {
+                memlz__fail(job);
+            }
+            memlz__scrub(state, job->dst + i * job->block_len, len);
+        }
+        else if (job->slot) {
+            // Each thread compresses into its own buffer of slot bytes and copies the block to
+            // its place once the block before it is placed. Blocks are taken in order, so that
+            // block is compressed already or nearly so
+            const size_t size = memlz_stream_compress(block, job->src + i * job->block_len, len, state);
+            memlz__scrub(state, job->src + i * job->block_len, len);
+            while (memlz__placed(job) != i) {
+                memlz__yield();
+            }
+            memcpy(job->dst + job->pos, block, size);
+            job->sizes[i] = size;
+            job->pos += size;
+            memlz__place(job, i + 1);
+        }
+        else {
+            job->sizes[i] = memlz_stream_compress(job->dst + job->pos, job->src + i * job->block_len, len, state);
+            job->pos += job->sizes[i];
+            memlz__scrub(state, job->src + i * job->block_len, len);
+        }
+    }
+
+    if (!job->state) {
+        free(state);
+    }
+    free(block);
+}
+
+#ifdef MEMLZ_THREADS
+#ifdef _WIN32
+static DWORD WINAPI memlz__thread(LPVOID job) {
+    memlz__work((memlz__job*)job);
+    return 0;
+}
+#else
+static void* memlz__thread(void* job) {
+    memlz__work((memlz__job*)job);
+    return 0;
+}
+#endif
+#endif
+
+// Runs the job on the calling thread plus up to threads - 1 additional threads. Threads that
+// fail to start are not an error because the remaining threads will pick up their blocks.
+static void memlz__run(memlz__job* job, size_t threads) {
+#ifdef MEMLZ_THREADS
+    threads = MEMLZ__MIN(threads, job->blocks);
+    size_t started = 0;
+#ifdef _WIN32
+    HANDLE* handles = (HANDLE*)malloc(threads * sizeof(HANDLE) + 1);
+    while (handles && started + 1 < threads) {
+        handles[started] = CreateThread(0, 0, memlz__thread, job, 0, 0);
+        if (!handles[started]) {
+            break;
+        }
+        started++;
+    }
+    memlz__work(job);
+    for (size_t t = 0; t < started; t++) {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+    }
+#else
+    pthread_t* handles = (pthread_t*)malloc(threads * sizeof(pthread_t) + 1);
+    while (handles && started + 1 < threads) {
+        if (pthread_create(&handles[started], 0, memlz__thread, job) != 0) {
+            break;
+        }
+        started++;
+    }
+    memlz__work(job);
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(handles[t], 0);
+    }
+#endif
+    free(handles);
+#else
+    (void)threads;
+    memlz__work(job);
+#endif
+}
+
+static size_t memlz__frame_max_len(size_t input, size_t block_len) {
+    size_t last = input % block_len;
+    return memlz_header_len() + 1 + sizeof(uint64_t) + 1
+        + input / block_len * (memlz_max_compressed_len(block_len) + sizeof(uint64_t))
+        + (last ? memlz_max_compressed_len(last) + sizeof(uint64_t) : 0);
+}
+
+static int memlz__is_frame(const void* src) {
+    size_t header_len = memlz__bytes(src) * memlz__fields;
+    return memlz_compressed_len(src) > header_len && ((const uint8_t*)src)[header_len] == MEMLZ__FRAME;
+}
+
+static size_t memlz__frame_compress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, size_t block_len, size_t threads) {
+    const size_t blocks = len / block_len + (len % block_len != 0);
+    const size_t header_len = memlz__fields * memlz__fit(memlz__frame_max_len(len, block_len));
+    const size_t base = header_len + 1 + memlz__fit(block_len);
+    uint8_t* dst = (uint8_t*)destination;
+
+    memlz__job job;
+    memset(&job, 0, sizeof(job));
+    job.dst = dst + base;
+    job.src = (const uint8_t*)source;
+    job.len = len;
+    job.block_len = block_len;
+    job.blocks = blocks;
+#ifdef MEMLZ_THREADS
+    job.slot = threads > 1 && blocks > 1 ? memlz_max_compressed_len(block_len) : 0;
+#endif
+    job.sizes = (size_t*)malloc(blocks * sizeof(size_t) + 1);
+    if (!job.sizes) {
+        return 0;
+    }
+
+    memlz__run(&job, threads);
+    if (job.failed || (job.slot && job.placed != blocks)) {
+        free(job.sizes);
+        return 0;
+    }
+
+    size_t pos = base;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t size = job.sizes[i];
+        job.sizes[i] = pos;
+        pos += size;
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        *(uint64_t*)(dst + pos) = job.sizes[i];
+        pos += sizeof(uint64_t);
+    }
+    free(job.sizes);
+
+    if (pos < memlz_header_len()) {
+        memset(dst + pos, 'M', memlz_header_len() - pos);
+        pos = memlz_header_len();
+    }
+
+    memlz__write(dst, len, header_len / memlz__fields);
+    memlz__write(dst + header_len / memlz__fields, pos, header_len / memlz__fields);
+    dst[header_len] = MEMLZ__FRAME;
+    memlz__write(dst + header_len + 1, block_len, memlz__fit(block_len));
+    return pos;
+}
+
+typedef struct memlz__frame_info {
+    const uint8_t* src;
+    const uint8_t* index;
+    size_t len;
+    size_t block_len;
+    size_t blocks;
+    size_t base;
+} memlz__frame_info;
+
+static int memlz__frame_open(memlz__frame_info* f, const void* source) {
+    const uint8_t* src = (const uint8_t*)source;
+    const size_t compressed_len = memlz_compressed_len(source);
+    const size_t header_len = memlz__bytes(source) * memlz__fields;
+
+    if (compressed_len < header_len + 2 || src[header_len] != MEMLZ__FRAME || compressed_len - header_len - 1 < memlz__bytes(src + header_len + 1)) {
+        return 0;
+    }
+
+    f->src = src;
+    f->len = memlz_decompressed_len(source);
+    f->block_len = memlz__read(src + header_len + 1);
+    f->base = header_len + 1 + memlz__bytes(src + header_len + 1);
+    if (f->block_len == 0) {
+        return 0;
+    }
+
+    f->blocks = f->len / f->block_len + (f->len % f->block_len != 0);
+    if (f->blocks > (compressed_len - f->base) / (memlz_header_len() + sizeof(uint64_t))) {
+        return 0;
+    }
+
+    f->index = src + compressed_len - f->blocks * sizeof(uint64_t);
+    return 1;
+}
+
+// Returns the offset of block i if it lies within the frame and its header agrees with the index, else 0
+static size_t memlz__frame_block(const memlz__frame_info* f, size_t i) {
+    uint64_t offset = ((const uint64_t*)f->index)[i];
+    uint64_t end = i + 1 < f->blocks ? ((const uint64_t*)f->index)[i + 1] : (uint64_t)(f->index - f->src);
+    if (offset < f->base || offset > end || end > (uint64_t)(f->index - f->src) || end - offset < memlz_header_len()
+        || memlz_compressed_len(f->src + offset) != end - offset
+        || memlz_decompressed_len(f->src + offset) != MEMLZ__MIN(f->block_len, f->len - i * f->block_len)) {
+        return 0;
+    }
+    return (size_t)offset;
+}
+
+// Decompress a frame with the given state, or with states allocated by each thread if it is 0
+static size_t memlz__frame_decompress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t threads, memlz_state* state) {
+    memlz__frame_info f;
+    if (!memlz__frame_open(&f, source)) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < f.blocks; i++) {
+        if (!memlz__frame_block(&f, i)) {
+            return 0;
+        }
+    }
+
+    memlz__job job;
+    memset(&job, 0, sizeof(job));
+    job.dst = (uint8_t*)destination;
+    job.src = f.src;
+    job.len = f.len;
+    job.block_len = f.block_len;
+    job.blocks = f.blocks;
+    job.index = f.index;
+    job.state = state;
+    job.decompress = 1;
+    memlz__run(&job, threads);
+    return job.failed ? 0 : f.len;
+}
+
+MEMLZ__UNUSED static size_t memlz_max_compressed_len_mt(size_t input) {
+    return memlz__frame_max_len(input, MEMLZ__FRAME_BLOCKLEN);
+}
+
+MEMLZ__UNUSED static size_t memlz_max_compressed_len_seekable(size_t input, size_t block_len) {
+    return block_len ? memlz__frame_max_len(input, block_len) : 0;
+}
+
+MEMLZ__UNUSED static size_t memlz_compress_seekable(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, size_t block_len) {
+    return block_len ? memlz__frame_compress(destination, source, len, block_len, 1) : 0;
+}
+
+MEMLZ__UNUSED static size_t memlz_decompress_range(const void* MEMLZ__RESTRICT source, size_t offset, size_t len, void* MEMLZ__RESTRICT destination) {
+    memlz__frame_info f;
+    if (!memlz__frame_open(&f, source) || offset > f.len || len > f.len - offset) {
+        return 0;
+    }
+
+    memlz_state* state = (memlz_state*)malloc(sizeof(memlz_state));
+    uint8_t* block = 0;
+    uint8_t* dst = (uint8_t*)destination;
+    size_t r = state ? len : 0;
+    if (state) {
+        memlz_reset(state);
+    }
+
+    for (size_t i = offset / f.block_len; r && i < f.blocks && i * f.block_len < offset + len; i++) {
+        const size_t start = i * f.block_len;
+        const size_t block_len = MEMLZ__MIN(f.block_len, f.len - start);
+        const size_t from = offset > start ? offset - start : 0;
+        const size_t to = MEMLZ__MIN(block_len, offset + len - start);
+        const size_t at = memlz__frame_block(&f, i);
+
+        if (!at) {
+            r = 0;
+            break;
+        }
+
+        // Blocks that are only partially covered are decompressed into a temporary buffer. The
+        // block length comes from the frame and can be larger than the data
+        uint8_t* out = dst;
+        if (from != 0 || to != block_len) {
+            block = block ? block : (uint8_t*)malloc(MEMLZ__MIN(f.block_len, f.len));
+            out = block;
+        }
+
+        if (!out || memlz_stream_decompress(out, f.src + at, state) != block_len) {
+            r = 0;
+            break;
+        }
+        memlz__scrub(state, out, block_len);
+        if (out != dst) {
+            memcpy(dst, out + from, to - from);
+        }
+        dst += to - from;
+    }
+
+    free(block);
+    free(state);
+    return r;
+}
+
+MEMLZ__UNUSED static size_t memlz_compress_mt(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, size_t threads) {
+    return memlz__frame_compress(destination, source, len, MEMLZ__FRAME_BLOCKLEN, threads);
+}
+
+MEMLZ__UNUSED static size_t memlz_decompress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source) {
+    if (memlz__is_frame(source)) {
+        return memlz__frame_decompress(destination, source, 1, 0);
+    }
+
+    memlz__options options;
+    const uint8_t* src = (const uint8_t*)source;
+    if (!memlz__read_options(src + memlz__bytes(src) * memlz__fields, src + memlz_compressed_len(src), &options)) {
+        return 0;
+    }
+
+    memlz_state* s = (memlz_state*)malloc(memlz_state_size_bits((int)options.bits));
+    if (!s) {
+        return 0;
+    }
+    memlz_reset_bits(s, (int)options.bits);
+    size_t r = memlz_stream_decompress(destination, source, s);
+    free(s);
+    return r;
+}
+
+MEMLZ__UNUSED static size_t memlz_decompress_mt(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t threads) {
+    if (!memlz__is_frame(source)) {
+        return memlz_decompress(destination, source);
+    }
+    return memlz__frame_decompress(destination, source, threads, 0);
+}
+
+// With a filter the tables hold words of the filtered data, which is filtered again a block at
+// a time together with the next block, so that the words that cross a block boundary are whole
+static void memlz__scrub_filtered(memlz_state* c, const uint8_t* data, size_t len, unsigned filter, size_t stride) {
+    if (!filter || !memlz__scrub_pays(c, len)) {
+        memlz__scrub(c, data, len);
+        return;
+    }
+    const size_t block = memlz__filter_block_len(stride);
+    const int kernel = memlz__selected_kernel();
+    uint8_t buf[2 * MEMLZ__MAX_FILTER_BLOCK];
+    for (size_t pos = 0; pos < len; pos += block) {
+        const size_t n = MEMLZ__MIN(2 * block, len - pos);
+        memlz__filter_block(buf, data + pos, pos, MEMLZ__MIN(block, n), filter, stride, kernel);
+        if (n > block) {
+            memlz__filter_block(buf + block, data + pos + block, pos + block, n - block, filter, stride, kernel);
+        }
+        memlz__clear_entries(c, buf, block, n);
+    }
+    memlz__reset_fields(c);
+}
+
+MEMLZ__UNUSED static size_t memlz_compress_with_state(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len, memlz_state* state) {
+    size_t r = memlz_stream_compress(destination, source, len, state);
+    memlz__scrub_filtered(state, (const uint8_t*)source, len, state->filter, state->stride);
+    return r;
+}
+
+// Like memlz_decompress_with_state(), and sets ok to whether the message was well-formed, which
+// the returned length does not tell for empty messages. A packet that decompresses adds its
+// compressed length to total_input before the state is scrubbed, and an empty frame has no
+// blocks that can fail once it opens
+static size_t memlz__decompress_message(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, memlz_state* state, int* ok) {
+    // Frames are compressed without a dictionary
+    if (memlz__is_frame(source)) {
+        memlz__frame_info f;
+        const size_t r = memlz__frame_decompress(destination, source, 1, state->dict ? 0 : state);
+        *ok = r > 0 || (memlz_decompressed_len(source) == 0 && memlz__frame_open(&f, source));
+        return r;
+    }
+    memlz__options options;
+    const uint8_t* src = (const uint8_t*)source;
+    *ok = 0;
+    if (!memlz__read_options(src + memlz__bytes(src) * memlz__fields, src + memlz_compressed_len(src), &options)) {
+        return 0;
+    }
+    const uint64_t input = state->total_input;
+    size_t r = memlz_stream_decompress(destination, source, state);
+    *ok = state->total_input != input;
+    // Malformed data can leave a mix of filtered and reversed data
+    memlz__scrub_filtered(state, (const uint8_t*)destination, r || !options.filter ? memlz_decompressed_len(source) : MEMLZ__SCRUB_LIMIT + 1, options.filter, options.stride);
+    return r;
+}
+
+MEMLZ__UNUSED static size_t memlz_decompress_with_state(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, memlz_state* state) {
+    int ok;
+    return memlz__decompress_message(destination, source, state, &ok);
+}
+
+MEMLZ__UNUSED static void memlz_set_checksum(memlz_state* state, int enable) {
+    state->checksum = enable != 0;
+}
+
+MEMLZ__UNUSED static int memlz_set_filter(memlz_state* state, int filter, size_t stride) {
+    if (filter == MEMLZ_FILTER_NONE) {
+        state->filter = MEMLZ_FILTER_NONE;
+        state->stride = 0;
+        return 1;
+    }
+    if (!memlz__valid_filter(filter, stride)) {
+        return 0;
+    }
+    state->filter = (uint8_t)filter;
+    state->stride = (uint8_t)stride;
+    return 1;
+}
+
+MEMLZ__UNUSED static void memlz_set_long_range(memlz_state* state, int enable) {
+    state->long_range = enable != 0;
+}
+
+MEMLZ__UNUSED static uint64_t memlz_compressed_checksum(const void* source) {
+    memlz__options options;
+    const uint8_t* src = (const uint8_t*)source;
+    if (memlz__is_frame(source) || !memlz__read_options(src + memlz__bytes(src) * memlz__fields, src + memlz_compressed_len(src), &options)) {
+        return 0;
+    }
+    return options.checksum;
+}
+
+// A dictionary consists of the 4 bytes "MLZD", the 32-bit ID, a byte with the table bits and
+// padding up to MEMLZ__DICT_HEADER bytes, followed by an image of the tables of a state.
+MEMLZ__UNUSED static size_t memlz_dictionary_len(int table_bits) {
+    return MEMLZ__DICT_HEADER + ((sizeof(uint64_t) + sizeof(uint32_t)) << memlz__bits(table_bits));
+}
+
+MEMLZ__UNUSED static uint32_t memlz_dictionary_id(const void* dictionary) {
+    return *(const uint32_t*)((const uint8_t*)dictionary + 4);
+}
+
+MEMLZ__UNUSED static uint32_t memlz_compressed_dictionary_id(const void* source) {
+    memlz__options options;
+    const uint8_t* src = (const uint8_t*)source;
+    if (memlz__is_frame(source) || !memlz__read_options(src + memlz__bytes(src) * memlz__fields, src + memlz_compressed_len(src), &options)) {
+        return 0;
+    }
+    return options.dict_id;
+}
+
+// Each entry keeps the word that wins a majority vote among the words that hash to it, which
+// is the most frequent one if it occurs in more than half of the cases, and a recent one else
+#define MEMLZ__VOTE(tbl, votes, h, v) \
+    if (tbl[h] == (v)) { \
+        votes[h]++; \
+    } \
+    else if (votes[h] == 0) { \
+        tbl[h] = (v); \
+        votes[h] = 1; \
+    } \
+    else { \
+        votes[h]--; \
+    }
+
+MEMLZ__UNUSED static size_t memlz_train_dictionary(void* dictionary, size_t capacity, const void* const* samples, const size_t* sample_lens, size_t count, int table_bits) {
+    const size_t bits = memlz__bits(table_bits);
+    const size_t len = memlz_dictionary_len(table_bits);
+    if (capacity < len) {
+        return 0;
+    }
+
+    memlz_state* state = (memlz_state*)malloc(memlz_state_size_bits((int)bits));
+    uint32_t* votes = (uint32_t*)calloc((size_t)2 << bits, sizeof(uint32_t));
+    if (!state || !votes) {
+        free(state);
+        free(votes);
+        return 0;
+    }
+    memlz_reset_bits(state, (int)bits);
+    uint64_t* hash64 = memlz__hash64_table(state);
+    uint32_t* hash32 = memlz__hash32_table(state);
+    uint32_t* votes64 = votes;
+    uint32_t* votes32 = votes + ((size_t)1 << bits);
+
+    // Words are read at offsets that are multiples of 4 bytes from the start of a packet
+    for (size_t s = 0; s < count; s++) {
+        const uint8_t* d = (const uint8_t*)samples[s];
+        for (size_t i = 0; i + sizeof(uint32_t) <= sample_lens[s]; i += sizeof(uint32_t)) {
+            uint32_t v32 = *(const uint32_t*)(d + i);
+            uint16_t h = memlz__hash32(v32, bits);
+            MEMLZ__VOTE(hash32, votes32, h, v32)
+            if (i + sizeof(uint64_t) <= sample_lens[s]) {
+                uint64_t v64 = *(const uint64_t*)(d + i);
+                h = memlz__hash64(v64, bits);
+                MEMLZ__VOTE(hash64, votes64, h, v64)
+            }
+        }
+    }
+
+    // The ID is a hash of the table size and the tables
+    uint8_t* dict = (uint8_t*)dictionary;
+    const size_t words = ((sizeof(uint64_t) + sizeof(uint32_t)) << bits) / sizeof(uint64_t);
+    uint64_t id = bits;
+    for (size_t i = 0; i < words; i++) {
+        id = (id ^ state->tables[i]) * 11400714819323198485ull;
+    }
+    uint32_t id32 = (uint32_t)(id >> 32);
+
+    memcpy(dict, "MLZD", 4);
+    memcpy(dict + 4, &id32, sizeof(uint32_t));
+    memset(dict + 8, 0, MEMLZ__DICT_HEADER - 8);
+    dict[8] = (uint8_t)bits;
+    memcpy(dict + MEMLZ__DICT_HEADER, state->tables, len - MEMLZ__DICT_HEADER);
+    if (id32 == 0) {
+        dict[4] = 1;
+    }
+
+    free(votes);
+    free(state);
+    return len;
+}
+
+MEMLZ__UNUSED static int memlz_state_load_dictionary(memlz_state* state, const void* dictionary, size_t len) {
+    const uint8_t* dict = (const uint8_t*)dictionary;
+    if (len < MEMLZ__DICT_HEADER || memcmp(dict, "MLZD", 4) || dict[8] < MEMLZ__MIN_BITS || dict[8] > MEMLZ__MAX_BITS
+        || len < memlz_dictionary_len(dict[8]) || memlz_dictionary_id(dict) == 0 || memlz__room(state, dict[8]) != dict[8]) {
+        return 0;
+    }
+    state->bits = dict[8];
+    state->dict = dict;
+    state->dict_id = memlz_dictionary_id(dict);
+    state->checksum = 0;
+    state->filter = MEMLZ_FILTER_NONE;
+    state->stride = 0;
+    state->long_range = 0;
+    state->cold = 0;
+    MEMLZ__STAT(memset(&state->stats, 0, sizeof(state->stats)));
+    memlz__reset_tables(state);
+    memlz__reset_fields(state);
+    return 1;
+}
+
+// A checkpoint consists of the 4 bytes "MLZS", a version byte, a byte each with the table bits,
+// checksum, filter, stride, long range setting and whether the tables were idle, padding, the
+// 32-bit dictionary ID and then 64-bit fields from offset 16 up to MEMLZ__SAVE_HEADER. Then
+// follows a bitmap for each table of the entries that differ from the reset state, and then
+// those entries.
+
+static void memlz__save_fields(uint64_t* f, const memlz_state* c) {
+    f[0] = c->total_input;
+    f[1] = c->total_output;
+    f[2] = c->mod;
+    f[3] = c->wordlen;
+    f[4] = c->cs4;
+    f[5] = c->cs8;
+    f[6] = c->incompressible;
+    f[7] = c->backoff;
+}
+
+static void memlz__load_fields(memlz_state* c, const uint64_t* f) {
+    c->total_input = f[0];
+    c->total_output = f[1];
+    c->mod = (size_t)f[2];
+    c->wordlen = (size_t)f[3];
+    c->cs4 = (size_t)f[4];
+    c->cs8 = (size_t)f[5];
+    c->incompressible = (size_t)f[6];
+    c->backoff = (size_t)f[7];
+}
+
+MEMLZ__UNUSED static size_t memlz_state_save_len(int table_bits) {
+    const size_t entries = (size_t)1 << memlz__bits(table_bits);
+    return MEMLZ__SAVE_HEADER + 2 * entries / 8 + (sizeof(uint64_t) + sizeof(uint32_t)) * entries;
+}
+
+MEMLZ__UNUSED static size_t memlz_state_save(const memlz_state* state, void* destination, size_t capacity) {
+    const size_t entries = (size_t)1 << state->bits;
+    if (state->reset != 'Y' || capacity < memlz_state_save_len((int)state->bits)) {
+        return 0;
+    }
+    uint8_t* dst = (uint8_t*)destination;
+    memcpy(dst, "MLZS", 4);
+    dst[4] = MEMLZ__SAVE_VERSION;
+    dst[5] = (uint8_t)state->bits;
+    dst[6] = (uint8_t)state->checksum;
+    dst[7] = state->filter;
+    dst[8] = state->stride;
+    dst[9] = (uint8_t)state->long_range;
+    dst[10] = state->cold ? 1 : 0;
+    dst[11] = 0;
+    memcpy(dst + 12, &state->dict_id, sizeof(uint32_t));
+    uint64_t fields[MEMLZ__SAVE_FIELDS];
+    memlz__save_fields(fields, state);
+    memcpy(dst + 16, fields, sizeof(fields));
+
+    // The tables of a state are one array of 64-bit words, with the 32-bit table in the last third
+    uint8_t* bitmap = dst + MEMLZ__SAVE_HEADER;
+    uint8_t* p = bitmap + 2 * entries / 8;
+    memset(bitmap, 0, 2 * entries / 8);
+    const uint64_t* hash64 = state->tables;
+    const uint32_t* hash32 = (const uint32_t*)(state->tables + entries);
+    const uint64_t* dict64 = state->dict ? (const uint64_t*)(state->dict + MEMLZ__DICT_HEADER) : 0;
+    const uint32_t* dict32 = state->dict ? (const uint32_t*)(dict64 + entries) : 0;
+    // The tables of an idle state count as reset, and are not read
+    for (size_t i = 0; i < entries && !state->cold; i++) {
+        if (hash64[i] != (dict64 ? dict64[i] : 0)) {
+            bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+            memcpy(p, &hash64[i], sizeof(uint64_t));
+            p += sizeof(uint64_t);
+        }
+    }
+    bitmap += entries / 8;
+    for (size_t i = 0; i < entries && !state->cold; i++) {
+        if (hash32[i] != (dict32 ? dict32[i] : 0)) {
+            bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+            memcpy(p, &hash32[i], sizeof(uint32_t));
+            p += sizeof(uint32_t);
+        }
+    }
+    return (size_t)(p - dst);
+}
+
+MEMLZ__UNUSED static int memlz_state_load(memlz_state* state, const void* source, size_t len) {
+    const uint8_t* src = (const uint8_t*)source;
+    if (len < MEMLZ__SAVE_HEADER || memcmp(src, "MLZS", 4) || src[4] != MEMLZ__SAVE_VERSION || src[5] < MEMLZ__MIN_BITS || src[5] > MEMLZ__MAX_BITS
+        || src[6] > 1 || src[9] > 1 || src[10] > 1 || (src[7] != MEMLZ_FILTER_NONE && !memlz__valid_filter(src[7], src[8]))) {
+        return 0;
+    }
+    const size_t bits = src[5];
+    const size_t entries = (size_t)1 << bits;
+    if (memlz__room(state, (int)bits) != (int)bits) {
+        return 0;
+    }
+    uint32_t dict_id;
+    uint64_t fields[MEMLZ__SAVE_FIELDS];
+    memcpy(&dict_id, src + 12, sizeof(uint32_t));
+    memcpy(fields, src + 16, sizeof(fields));
+    if ((fields[3] != 4 && fields[3] != 8) || len < MEMLZ__SAVE_HEADER + 2 * entries / 8) {
+        return 0;
+    }
+
+    // Check that the entries fit before the state is changed
+    const uint8_t* bitmap = src + MEMLZ__SAVE_HEADER;
+    size_t set64 = 0;
+    size_t set32 = 0;
+    for (size_t i = 0; i < entries / 8; i++) {
+        set64 += memlz__popcount16(bitmap[i]);
+        set32 += memlz__popcount16(bitmap[i + entries / 8]);
+    }
+    if (len - MEMLZ__SAVE_HEADER - 2 * entries / 8 < set64 * sizeof(uint64_t) + set32 * sizeof(uint32_t)) {
+        return 0;
+    }
+
+    if (dict_id == 0) {
+        memlz_reset_bits(state, (int)bits);
+    }
+    else if (state->dict_id == dict_id && state->bits == bits) {
+        memlz__reset_tables(state);
+        MEMLZ__STAT(memset(&state->stats, 0, sizeof(state->stats)));
+    }
+    else {
+        return 0;
+    }
+
+    const uint8_t* p = bitmap + 2 * entries / 8;
+    uint64_t* hash64 = memlz__hash64_table(state);
+    uint32_t* hash32 = memlz__hash32_table(state);
+    for (size_t i = 0; i < entries; i++) {
+        if (bitmap[i / 8] >> (i % 8) & 1) {
+            memcpy(&hash64[i], p, sizeof(uint64_t));
+            p += sizeof(uint64_t);
+        }
+    }
+    bitmap += entries / 8;
+    for (size_t i = 0; i < entries; i++) {
+        if (bitmap[i / 8] >> (i % 8) & 1) {
+            memcpy(&hash32[i], p, sizeof(uint32_t));
+            p += sizeof(uint32_t);
+        }
+    }
+    state->checksum = (char)src[6];
+    state->filter = src[7];
+    state->stride = src[8];
+    state->long_range = (char)src[9];
+    state->cold = src[10] ? MEMLZ__COLD_ZERO : 0;
+    memlz__reset_fields(state);
+    memlz__load_fields(state, fields);
+    return 1;
+}
+
+MEMLZ__UNUSED static void memlz_state_clone(memlz_state* destination, const memlz_state* source) {
+#ifdef MEMLZ_POOL
+    // A state of a pool stays one
+    const uint64_t pool_tag = destination->pool_tag;
+    const size_t pool_bits = destination->pool_bits;
+    memcpy(destination, source, memlz_state_size_bits((int)source->bits));
+    destination->pool_tag = pool_tag;
+    destination->pool_bits = pool_bits;
+#else
+    memcpy(destination, source, memlz_state_size_bits((int)source->bits));
+#endif
+}
+
+#ifdef MEMLZ_POOL
+// A pool maps chunks of about MEMLZ__POOL_CHUNK bytes that are split into page aligned states,
+// and keeps the states that are not in use in a list. The first page of a state holds its
+// settings and fields, and the pages after it hold only table entries, so they can be given
+// back to the system without losing the position of the stream.
+struct memlz_pool {
+    size_t bits;
+    size_t page;
+    size_t stride;
+    size_t per_chunk;
+    size_t chunk_len;
+    int flags;
+    int huge;
+    uint8_t** chunks;
+    size_t chunk_count;
+    memlz_state** free_states;
+    size_t free_count;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+static void memlz__pool_lock(memlz_pool* pool) {
+#ifdef _WIN32
+    EnterCriticalSection(&pool->lock);
+#else
+    pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void memlz__pool_unlock(memlz_pool* pool) {
+#ifdef _WIN32
+    LeaveCriticalSection(&pool->lock);
+#else
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+// Map zeroed memory for a chunk, as huge pages if asked for and granted, and else as normal
+// pages that the system may back with transparent huge pages
+static uint8_t* memlz__pool_map(memlz_pool* pool) {
+    const int huge = pool->flags & MEMLZ_POOL_HUGE_PAGES;
+#ifdef _WIN32
+    const size_t large = GetLargePageMinimum();
+    if (huge && large) {
+        const size_t len = (pool->chunk_len + large - 1) / large * large;
+        void* p = VirtualAlloc(0, len, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p) {
+            pool->huge = 1;
+            return (uint8_t*)p;
+        }
+    }
+    return (uint8_t*)VirtualAlloc(0, pool->chunk_len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+    if (huge) {
+        void* p = mmap(0, pool->chunk_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            pool->huge = 1;
+            return (uint8_t*)p;
+        }
+    }
+#endif
+    void* p = mmap(0, pool->chunk_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(p, pool->chunk_len, MADV_HUGEPAGE);
+    }
+#endif
+    return (uint8_t*)p;
+#endif
+}
+
+static void memlz__pool_unmap(memlz_pool* pool, uint8_t* chunk) {
+#ifdef _WIN32
+    (void)pool;
+    VirtualFree(chunk, 0, MEM_RELEASE);
+#else
+    munmap(chunk, pool->chunk_len);
+#endif
+}
+
+// Give the whole pages of the tables of a state back to the system, which fills them with zeros
+// when they are touched again, and clear the rest. Returns 0 if the pages cannot be given back,
+// which is the case for huge pages
+static int memlz__pool_discard(memlz_pool* pool, memlz_state* state) {
+    if (pool->huge) {
+        return 0;
+    }
+    uint8_t* begin = (uint8_t*)state->tables;
+    uint8_t* end = begin + ((sizeof(uint64_t) + sizeof(uint32_t)) << pool->bits);
+    uint8_t* first = (uint8_t*)(((uintptr_t)begin + pool->page - 1) & ~(uintptr_t)(pool->page - 1));
+    uint8_t* last = (uint8_t*)((uintptr_t)end & ~(uintptr_t)(pool->page - 1));
+    if (first >= last) {
+        memset(begin, 0, (size_t)(end - begin));
+        return 1;
+    }
+#ifdef _WIN32
+    if (!VirtualFree(first, (size_t)(last - first), MEM_DECOMMIT) || !VirtualAlloc(first, (size_t)(last - first), MEM_COMMIT, PAGE_READWRITE)) {
+        return 0;
+    }
+#elif defined(__linux__)
+    // Private anonymous pages read as zero after MADV_DONTNEED on Linux, but not on all systems
+    if (madvise(first, (size_t)(last - first), MADV_DONTNEED)) {
+        return 0;
+    }
+#else
+    if (mmap(first, (size_t)(last - first), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return 0;
+    }
+#endif
+    memset(begin, 0, (size_t)(first - begin));
+    memset(last, 0, (size_t)(end - last));
+    return 1;
+}
+
+MEMLZ__UNUSED static memlz_pool* memlz_pool_create(int table_bits, int flags) {
+    memlz_pool* pool = (memlz_pool*)calloc(1, sizeof(memlz_pool));
+    if (!pool) {
+        return 0;
+    }
+    pool->bits = memlz__bits(table_bits);
+    pool->flags = flags;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    pool->page = info.dwPageSize;
+#else
+    const long page = sysconf(_SC_PAGESIZE);
+    pool->page = page > 0 ? (size_t)page : 4096;
+#endif
+    pool->stride = (memlz_state_size_bits((int)pool->bits) + pool->page - 1) / pool->page * pool->page;
+    pool->per_chunk = MEMLZ__POOL_CHUNK / pool->stride ? MEMLZ__POOL_CHUNK / pool->stride : 1;
+    pool->chunk_len = (pool->per_chunk * pool->stride + MEMLZ__HUGE_PAGE - 1) / MEMLZ__HUGE_PAGE * MEMLZ__HUGE_PAGE;
+
+    uint8_t* chunk = memlz__pool_map(pool);
+    pool->chunks = (uint8_t**)malloc(sizeof(uint8_t*));
+    pool->free_states = (memlz_state**)malloc(pool->per_chunk * sizeof(memlz_state*));
+    if (!chunk || !pool->chunks || !pool->free_states) {
+        if (chunk) {
+            memlz__pool_unmap(pool, chunk);
+        }
+        free(pool->chunks);
+        free(pool->free_states);
+        free(pool);
+        return 0;
+    }
+    pool->chunks[pool->chunk_count++] = chunk;
+    for (size_t i = pool->per_chunk; i > 0; i--) {
+        memlz_state* state = (memlz_state*)(chunk + (i - 1) * pool->stride);
+        state->cold = MEMLZ__COLD_ZERO;
+        state->pool_tag = (uint64_t)(uintptr_t)state ^ MEMLZ__POOL_TAG;
+        state->pool_bits = pool->bits;
+        pool->free_states[pool->free_count++] = state;
+    }
+#ifdef _WIN32
+    InitializeCriticalSection(&pool->lock);
+#else
+    pthread_mutex_init(&pool->lock, 0);
+#endif
+    return pool;
+}
+
+MEMLZ__UNUSED static void memlz_pool_destroy(memlz_pool* pool) {
+    if (!pool) {
+        return;
+    }
+    for (size_t i = 0; i < pool->chunk_count; i++) {
+        memlz__pool_unmap(pool, pool->chunks[i]);
+    }
+#ifdef _WIN32
+    DeleteCriticalSection(&pool->lock);
+#else
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    free(pool->chunks);
+    free(pool->free_states);
+    free(pool);
+}
+
+// Add a chunk of states to the list of free states. Returns 0 if internal memory allocation failed
+static int memlz__pool_grow(memlz_pool* pool) {
+    const size_t states = (pool->chunk_count + 1) * pool->per_chunk;
+    uint8_t** chunks = (uint8_t**)realloc(pool->chunks, (pool->chunk_count + 1) * sizeof(uint8_t*));
+    if (!chunks) {
+        return 0;
+    }
+    pool->chunks = chunks;
+    memlz_state** free_states = (memlz_state**)realloc(pool->free_states, states * sizeof(memlz_state*));
+    if (!free_states) {
+        return 0;
+    }
+    pool->free_states = free_states;
+    uint8_t* chunk = memlz__pool_map(pool);
+    if (!chunk) {
+        return 0;
+    }
+    pool->chunks[pool->chunk_count++] = chunk;
+    for (size_t i = pool->per_chunk; i > 0; i--) {
+        memlz_state* state = (memlz_state*)(chunk + (i - 1) * pool->stride);
+        state->cold = MEMLZ__COLD_ZERO;
+        state->pool_tag = (uint64_t)(uintptr_t)state ^ MEMLZ__POOL_TAG;
+        state->pool_bits = pool->bits;
+        pool->free_states[pool->free_count++] = state;
+    }
+    return 1;
+}
+
+MEMLZ__UNUSED static memlz_state* memlz_pool_acquire(memlz_pool* pool) {
+    memlz__pool_lock(pool);
+    memlz_state* state = pool->free_count > 0 || memlz__pool_grow(pool) ? pool->free_states[--pool->free_count] : 0;
+    memlz__pool_unlock(pool);
+    if (state) {
+        // The tables are reset when they are used, see memlz__warm()
+        const char cold = state->cold;
+        memlz__reset_settings(state, (int)pool->bits);
+        memlz__reset_fields(state);
+        state->cold = cold;
+    }
+    return state;
+}
+
+MEMLZ__UNUSED static void memlz_pool_idle(memlz_pool* pool, memlz_state* state) {
+    if (state->cold != MEMLZ__COLD_ZERO) {
+        state->cold = memlz__pool_discard(pool, state) ? MEMLZ__COLD_ZERO : MEMLZ__COLD_DIRTY;
+    }
+}
+
+MEMLZ__UNUSED static void memlz_pool_release(memlz_pool* pool, memlz_state* state) {
+    if (!state) {
+        return;
+    }
+    memlz_pool_idle(pool, state);
+    memlz__pool_lock(pool);
+    pool->free_states[pool->free_count++] = state;
+    memlz__pool_unlock(pool);
+}
+#endif
+
+#ifdef MEMLZ_STATS
+MEMLZ__UNUSED static const memlz_stats* memlz_get_stats(const memlz_state* state) {
+    return &state->stats;
+}
+
+MEMLZ__UNUSED static void memlz_reset_stats(memlz_state* state) {
+    memset(&state->stats, 0, sizeof(state->stats));
+}
+#endif
+
+MEMLZ__UNUSED static size_t memlz_compress(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len) {
+    memlz_state* s = (memlz_state*)malloc(sizeof(memlz_state));
     if (!s) {
         return 0;
     }
@@ -592,23 +4166,200 @@ MEMLZ__UNUSED static size_t memlz_compress(void* MEMLZ__RESTRICT destination, co
     return r;
 }
 
+static size_t memlz__store(void* MEMLZ__RESTRICT destination, const void* MEMLZ__RESTRICT source, size_t len) {
+    const size_t field_len = memlz__fit(memlz_max_compressed_len(len));
+    const size_t words = len & ~(sizeof(uint64_t) - 1);
+    const size_t stored_len = memlz_stored_len(len);
+    uint8_t* dst = (uint8_t*)destination;
+    memlz__write(dst, len, field_len);
+    memlz__write(dst + field_len, stored_len, field_len);
+    dst += memlz__fields * field_len;
+    *dst++ = MEMLZ__UNCOMPRESSED;
+    memlz__write(dst, words, memlz__fit(words));
+    dst += memlz__fit(words);
+    memcpy(dst, source, words);
+    dst += words;
+    *dst++ = MEMLZ__NORMAL64;
+    memcpy(dst, (const uint8_t*)source + words, len - words);
+    dst += len - words;
+    memset(dst, 'M', stored_len - (size_t)(dst - (uint8_t*)destination));
+    return stored_len;
+}
+
+MEMLZ__UNUSED static size_t memlz_compress_bounded(void* MEMLZ__RESTRICT destination, size_t capacity, const void* MEMLZ__RESTRICT source, size_t len) {
+    memlz_state* s = (memlz_state*)malloc(sizeof(memlz_state));
+    if (!s) {
+        return 0;
+    }
+    memlz_reset(s);
+    memlz_iovec segment;
+    segment.iov_base = (void*)source;
+    segment.iov_len = len;
+    size_t r = memlz__stream_compress(destination, capacity, &segment, 1, s);
+    free(s);
+    if (r == 0 && memlz_stored_len(len) <= capacity) {
+        r = memlz__store(destination, source, len);
+    }
+    return r;
+}
+
+// A batch state is allocated for the table size of the dictionary if there is one, and else for
+// table_bits. Returns 0 if the dictionary is malformed.
+static memlz_state* memlz__batch_state(const memlz_batch_options* o, int table_bits) {
+    const uint8_t* dict = (const uint8_t*)o->dictionary;
+    const int bits = dict ? (o->dictionary_len > 8 ? dict[8] : 0) : table_bits;
+    memlz_state* state = (memlz_state*)malloc(memlz_state_size_bits(bits));
+    if (!state) {
+        return 0;
+    }
+    if (!dict) {
+        memlz_reset_bits(state, bits);
+    }
+    else if (!memlz_state_load_dictionary(state, dict, o->dictionary_len)) {
+        free(state);
+        return 0;
+    }
+    return state;
+}
+
+MEMLZ__UNUSED static size_t memlz_compress_batch(void* const* destinations, const void* const* sources, const size_t* lens, size_t count, size_t* compressed_lens, const memlz_batch_options* options) {
+    const memlz_batch_options defaults = { 0, 0, 0, 0, MEMLZ_FILTER_NONE, 0 };
+    const memlz_batch_options* o = options ? options : &defaults;
+    if (o->table_bits != 0 && (o->table_bits < MEMLZ__MIN_BITS || o->table_bits > MEMLZ__MAX_BITS)) {
+        return 0;
+    }
+    memlz_state* state = memlz__batch_state(o, o->table_bits ? o->table_bits : MEMLZ__MAX_BITS);
+    if (!state) {
+        return 0;
+    }
+    memlz_set_checksum(state, o->checksum);
+    if (!memlz_set_filter(state, o->filter, o->stride)) {
+        free(state);
+        return 0;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        compressed_lens[i] = memlz_compress_with_state(destinations[i], sources[i], lens[i], state);
+        total += compressed_lens[i];
+    }
+    free(state);
+    return total;
+}
+
+MEMLZ__UNUSED static size_t memlz_decompress_batch(void* const* destinations, const void* const* sources, size_t count, size_t* decompressed_lens, const memlz_batch_options* options) {
+    const memlz_batch_options defaults = { 0, 0, 0, 0, MEMLZ_FILTER_NONE, 0 };
+    const memlz_batch_options* o = options ? options : &defaults;
+    // Without a dictionary the state is reset to the table size of each message that needs
+    // another one than the previous message, so it is allocated for the largest
+    memlz_state* state = memlz__batch_state(o, MEMLZ__MAX_BITS);
+    if (!state) {
+        return 0;
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < count; i++) {
+        memlz__options opt;
+        const uint8_t* src = (const uint8_t*)sources[i];
+        if (!o->dictionary && !memlz__is_frame(src) && memlz__read_options(src + memlz__bytes(src) * memlz__fields, src + memlz_compressed_len(src), &opt)
+            && opt.bits != state->bits) {
+            memlz_reset_bits(state, (int)opt.bits);
+        }
+        int ok;
+        decompressed_lens[i] = memlz__decompress_message(destinations[i], src, state, &ok);
+        done += ok;
+    }
+    free(state);
+    return done;
+}
+
 #undef MEMLZ__UNROLL4
+#undef MEMLZ__DEC_HEADER
+#undef MEMLZ__DEC_OPTIONS
+#undef MEMLZ__DEC_BLOCKS
+#undef MEMLZ__DEC_END
 #undef MEMLZ__UNROLL16
 #undef MEMLZ__ENCODE_WORD
+#undef MEMLZ__ENCODE4
+#undef MEMLZ__ENCODE_ROUND
+#undef MEMLZ__EMIT16
+#undef MEMLZ__ROUND64
+#undef MEMLZ__ROUND32
+#undef MEMLZ__TARGET
+#undef MEMLZ__INLINE
+#undef MEMLZ__NOINLINE
+#undef MEMLZ__ROUND
+#undef MEMLZ__RLE_WORDS
+#undef MEMLZ__NEON_RLE
+#undef MEMLZ__PAIR
+#undef MEMLZ__NEON_PAIR
+#undef MEMLZ__X86
+#undef MEMLZ__NEON
 #undef MEMLZ__DECODE_WORD
+#undef MEMLZ__DECODE4
+#undef MEMLZ__R0
+#undef MEMLZ__R1
 #undef MEMLZ__VOID
 #undef MEMLZ__NORMAL32
 #undef MEMLZ__NORMAL64
 #undef MEMLZ__UNCOMPRESSED
+#undef MEMLZ__OPTIONS
+#undef MEMLZ__OPT_BITS
+#undef MEMLZ__OPT_DICT
+#undef MEMLZ__OPT_CHECKSUM
+#undef MEMLZ__OPT_FILTER
+#undef MEMLZ__OPT_RESET
+#undef MEMLZ__COLD_ZERO
+#undef MEMLZ__COLD_DIRTY
+#undef MEMLZ__POOL_CHUNK
+#undef MEMLZ__POOL_TAG
+#undef MEMLZ__HUGE_PAGE
+#undef MEMLZ__MAX_STRIDE
+#undef MEMLZ__MAX_FILTER_BLOCK
+#undef MEMLZ__MAX_BLOCK_INPUT
+#undef MEMLZ__SUM_CHUNK
+#undef MEMLZ__P1
+#undef MEMLZ__P2
+#undef MEMLZ__P3
+#undef MEMLZ__P4
+#undef MEMLZ__ROTL64
+#undef MEMLZ__DICT_HEADER
+#undef MEMLZ__SAVE_HEADER
+#undef MEMLZ__SAVE_VERSION
+#undef MEMLZ__SAVE_FIELDS
+#undef MEMLZ__VOTE
+#undef MEMLZ__MIN_BITS
+#undef MEMLZ__MAX_BITS
+#undef MEMLZ__FRAME
+#undef MEMLZ__PAGES
+#undef MEMLZ__PAGE
+#undef MEMLZ__PAGE_BITS
+#undef MEMLZ__PAGE_SAMPLES
+#undef MEMLZ__PAGE_SAMPLE
+#undef MEMLZ__FRAME_BLOCKLEN
 #undef MEMLZ__RLE
 #undef MEMLZ__WORDPROBE4096
 #undef MEMLZ__BLOCKLEN
 #undef MEMLZ__MIN
+#undef MEMLZ__STAT
+#undef MEMLZ__TIMER
+#undef MEMLZ__TIMER_ADD
 #undef MEMLZ__DO_RLE
 #undef MEMLZ__DO_INCOMPRESSIBLE
 #undef MEMLZ__INCOMPRESSIBLE
+#undef MEMLZ__INCOMPRESSIBLE_STREAK
 #undef MEMLZ__PROBELEN
 #undef MEMLZ__MIN_RLE
+#undef MEMLZ__LOOKAHEAD
+#undef MEMLZ__GATHER
+#undef MEMLZ__BAIL_TOLERANCE
+#undef MEMLZ__PREFETCH
+#undef MEMLZ__NEXT_WINDOW
+#undef MEMLZ__SCRUB_LIMIT
+#undef MEMLZ__SCRUB_RATIO
+#undef MEMLZ__SIMD_BACKOFF
+#undef MEMLZ__SIMD_HITS
+#undef MEMLZ__SIMD_HITS_BACKOFF
 #undef MEMLZ__RESTRICT
 #undef MEM_UNUSED
 
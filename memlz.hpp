@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: MIT
+//
+// memlz 0.2 beta - C++ front-end with compressors that are specialized at compile time
+//
+// Copyright 2025, Lasse Mikkel Reinhold
+//
+// memlz_stream_compress() selects the word length at runtime, which costs a test in every
+// round, and it keeps tables for both word lengths. The memlz::basic_compressor template
+// fixes the word type, the table size and the optional block types at compile time instead,
+// so that each instantiation has an inner loop without those tests and a state with only
+// the one table it needs. The output is ordinary memlz data that memlz_decompress() and
+// memlz_stream_decompress() can decompress.
+
+#ifndef memlz__hpp
+#define memlz__hpp
+
+#include "memlz.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace memlz {
+
+/// Optional block types of the compressor. Decompression always supports all of them
+enum features : unsigned {
+    none = 0,
+    rle = 1,            // Encode runs of equal 8-byte words as RLE blocks
+    incompressible = 2, // Store data where nothing matches as uncompressed blocks
+    all = rle | incompressible
+};
+
+namespace detail {
+
+inline uint16_t hash(uint64_t v, size_t bits) {
+    return memlz__hash64(v, bits);
+}
+
+inline uint16_t hash(uint32_t v, size_t bits) {
+    return memlz__hash32(v, bits);
+}
+
+}
+
+/// Compressor with a word type of uint32_t or uint64_t, a hash table of 2^TableBits entries,
+/// where TableBits is from 10 to 16, and the block types of Features. The object holds the
+/// table, which is 512 KB for 8-byte words and 16 bits, so allocate large ones on the heap.
+///
+/// Each call to compress() continues the stream of the previous calls like
+/// memlz_stream_compress(). Decompress the packets with memlz_stream_decompress() and a state
+/// that was reset with memlz_reset_bits(state, TableBits), or with memlz_decompress() if
+/// reset() was called before each packet.
+template<class WordT, int TableBits = 16, unsigned Features = all>
+class basic_compressor {
+    static_assert(std::is_same<WordT, uint32_t>::value || std::is_same<WordT, uint64_t>::value, "WordT must be uint32_t or uint64_t");
+    static_assert(TableBits >= 10 && TableBits <= 16, "TableBits must be from 10 to 16");
+
+public:
+    static constexpr size_t table_bits = TableBits;
+    static constexpr size_t word_size = sizeof(WordT);
+
+    basic_compressor() {
+        reset();
+    }
+
+    /// Start a new stream
+    void reset() {
+        memset(table_, 0, sizeof(table_));
+        incompressible_ = 0;
+    }
+
+    /// The destination buffer must be at least memlz_max_compressed_len(len) large.
+    ///
+    /// Returns the number of bytes written to destination
+    size_t compress(void* __restrict destination, const void* __restrict source, size_t len);
+
+private:
+    WordT table_[size_t(1) << TableBits];
+    size_t incompressible_;
+};
+
+template<class WordT, int TableBits, unsigned Features>
+size_t basic_compressor<WordT, TableBits, Features>::compress(void* __restrict destination, const void* __restrict source, size_t len) {
+    const size_t max = memlz_max_compressed_len(len) > len ? memlz_max_compressed_len(len) : len;
+    const size_t field_len = memlz__fit(max);
+    const uint8_t* src = (const uint8_t*)source;
+    uint8_t* dst = (uint8_t*)destination + 2 * field_len;
+    size_t missing = len;
+    uint16_t flags = 0;
+
+    if (TableBits != memlz__max_bits) {
+        *dst++ = memlz__block_options;
+        *dst++ = memlz__opt_bits;
+        *dst++ = (uint8_t)TableBits;
+    }
+
+    for (;;) {
+        if (Features & rle) {
+            size_t e = sizeof(uint64_t);
+            if (missing >= 2 * sizeof(uint64_t) && ((const uint64_t*)src)[1] == *(const uint64_t*)src) {
+                e = memlz__rle_scalar(src, 2, missing / sizeof(uint64_t)) * sizeof(uint64_t);
+            }
+            if (e >= memlz__min_rle) {
+                *dst++ = memlz__block_rle;
+                size_t length = memlz__fit(e);
+                memlz__write(dst, e, length);
+                *(uint64_t*)(dst + length) = *(const uint64_t*)src;
+                dst += sizeof(uint64_t) + length;
+                missing -= e;
+                src += e;
+                continue;
+            }
+        }
+
+        *dst++ = sizeof(WordT) == 8 ? memlz__block_normal64 : memlz__block_normal32;
+        if (missing < 16 * sizeof(WordT)) {
+            break;
+        }
+
+        // The table is written for hits as well, because it already holds the word, and a
+        // reference is written as a full word of which only 2 bytes are kept, so that the
+        // only thing that depends on the match is how far dst advances
+        uint16_t* flags_ptr = (uint16_t*)dst;
+        dst += 2;
+        for (int i = 0; i < 16; i++) {
+            const WordT v = ((const WordT*)src)[i];
+            const uint16_t h = detail::hash(v, TableBits);
+            const WordT old = table_[h];
+            const unsigned hit = old == v;
+            table_[h] = v;
+            *(WordT*)dst = hit ? (WordT)h : v;
+            dst += hit ? 2 : sizeof(WordT);
+            flags = (uint16_t)(flags << 1 | hit);
+        }
+        *flags_ptr = flags;
+        src += 16 * sizeof(WordT);
+        missing -= 16 * sizeof(WordT);
+
+        if (Features & incompressible) {
+            // The same blocks as memlz_stream_compress() writes, which stop before runs
+            incompressible_ = flags ? 0 : incompressible_ + 1;
+            size_t u = memlz__incompressible_len(incompressible_, missing);
+            u = u > 0 ? memlz__store_len(src, u, MEMLZ_KERNEL_SCALAR) : 0;
+            if (u > 0) {
+                *dst++ = memlz__block_uncompressed;
+                memlz__write(dst, u, memlz__fit(u));
+                dst += memlz__fit(u);
+                memcpy(dst, src, u);
+                dst += u;
+                src += u;
+                missing -= u;
+            }
+        }
+    }
+
+    if (missing >= sizeof(WordT)) {
+        uint16_t* flags_ptr = (uint16_t*)dst;
+        dst += 2;
+        flags = 0;
+        size_t words = missing / sizeof(WordT);
+        for (size_t i = 0; i < words; i++) {
+            const WordT v = ((const WordT*)src)[i];
+            const uint16_t h = detail::hash(v, TableBits);
+            const unsigned hit = table_[h] == v;
+            table_[h] = v;
+            if (hit) {
+                *(uint16_t*)dst = h;
+                dst += 2;
+            }
+            else {
+                memcpy(dst, &v, sizeof(WordT));
+                dst += sizeof(WordT);
+            }
+            flags = (uint16_t)(flags << 1 | hit);
+        }
+        *flags_ptr = (uint16_t)(flags << (16 - words));
+        src += words * sizeof(WordT);
+        missing -= words * sizeof(WordT);
+    }
+
+    memcpy(dst, src, missing);
+    dst += missing;
+
+    size_t compressed_len = (size_t)(dst - (uint8_t*)destination);
+    if (compressed_len < memlz_header_len()) {
+        memset(dst, 'M', memlz_header_len() - compressed_len);
+        compressed_len = memlz_header_len();
+    }
+
+    memlz__write(destination, len, field_len);
+    memlz__write((uint8_t*)destination + field_len, compressed_len, field_len);
+    return compressed_len;
+}
+
+/// Compressor that dispatches at runtime to a basic_compressor instantiation, for callers
+/// that only know the word size, table size and features at runtime. A word_size of 0 lets
+/// the first call to compress() after construction or reset() pick the word size that
+/// compresses the beginning of its input best.
+class compressor {
+public:
+    explicit compressor(size_t word_size = 0, int table_bits = 16, unsigned features = all)
+        : word_size_(word_size == 4 || word_size == 8 ? word_size : 0), auto_(word_size_ == 0),
+          bits_((int)memlz__bits(table_bits)), features_(features & all) {
+        if (!auto_) {
+            create();
+        }
+    }
+
+    /// Start a new stream
+    void reset() {
+        if (auto_) {
+            impl_.reset();
+            word_size_ = 0;
+        }
+        else if (impl_) {
+            impl_->reset();
+        }
+    }
+
+    /// The destination buffer must be at least memlz_max_compressed_len(len) large.
+    ///
+    /// Returns the number of bytes written to destination, or 0 if memory allocation failed
+    size_t compress(void* __restrict destination, const void* __restrict source, size_t len) {
+        if (!impl_) {
+            if (word_size_ == 0) {
+                word_size_ = probe(source, len);
+            }
+            create();
+            if (!impl_) {
+                return 0;
+            }
+        }
+        return impl_->compress(destination, source, len);
+    }
+
+    /// The word size in use, or 0 if it has not been picked yet
+    size_t word_size() const {
+        return word_size_;
+    }
+
+    int table_bits() const {
+        return bits_;
+    }
+
+private:
+    struct base {
+        virtual ~base() {}
+        virtual void reset() = 0;
+        virtual size_t compress(void* destination, const void* source, size_t len) = 0;
+    };
+
+    template<class C>
+    struct holder : base {
+        C c;
+        void reset() override {
+            c.reset();
+        }
+        size_t compress(void* destination, const void* source, size_t len) override {
+            return c.compress(destination, source, len);
+        }
+    };
+
+    typedef base* (*factory)();
+
+    template<class WordT, int TableBits, unsigned Features>
+    static base* make() {
+        return new (std::nothrow) holder<basic_compressor<WordT, TableBits, Features> >();
+    }
+
+    template<class WordT, unsigned Features>
+    static base* make(int bits) {
+        static const factory f[] = {
+            make<WordT, 10, Features>, make<WordT, 11, Features>, make<WordT, 12, Features>, make<WordT, 13, Features>,
+            make<WordT, 14, Features>, make<WordT, 15, Features>, make<WordT, 16, Features>
+        };
+        return f[bits - 10]();
+    }
+
+    template<class WordT>
+    static base* make(int bits, unsigned features) {
+        return features == all ? make<WordT, all>(bits)
+            : features == rle ? make<WordT, rle>(bits)
+            : features == incompressible ? make<WordT, incompressible>(bits)
+            : make<WordT, none>(bits);
+    }
+
+    void create() {
+        impl_.reset(word_size_ == 8 ? make<uint64_t>(bits_, features_) : make<uint32_t>(bits_, features_));
+    }
+
+    // Compress a sample with small tables for both word sizes, like memlz_stream_compress()
+    // does at the start of every block
+    static size_t probe(const void* source, size_t len) {
+        const size_t sample = len < 2 * 1024 ? len : 2 * 1024;
+        std::unique_ptr<uint8_t[]> out(new (std::nothrow) uint8_t[memlz_max_compressed_len(sample)]);
+        std::unique_ptr<basic_compressor<uint64_t, 10, none> > c8(new (std::nothrow) basic_compressor<uint64_t, 10, none>());
+        std::unique_ptr<basic_compressor<uint32_t, 10, none> > c4(new (std::nothrow) basic_compressor<uint32_t, 10, none>());
+        if (!out || !c8 || !c4) {
+            return 8;
+        }
+        size_t len8 = c8->compress(out.get(), source, sample);
+        size_t len4 = c4->compress(out.get(), source, sample);
+        return len4 < len8 ? 4 : 8;
+    }
+
+    size_t word_size_;
+    bool auto_;
+    int bits_;
+    unsigned features_;
+    std::unique_ptr<base> impl_;
+};
+
+}
+
+#endif
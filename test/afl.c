@@ -10,6 +10,7 @@
 #endif // _WIN32
 
 
+#define MEMLZ_POOL
 #include "../memlz.h"
 
 #ifndef __AFL_LOOP
@@ -27,6 +28,479 @@ char* realloc_or_abort(char* ptr, size_t len) {
 
 size_t max_original_len = 1024 * 1024;
 
+// Split sizes must be the same for each run of an input, so they come from a generator that is
+// seeded with the input
+uint64_t split_seed = 1;
+
+size_t next_split(size_t max) {
+    split_seed ^= split_seed << 13;
+    split_seed ^= split_seed >> 7;
+    split_seed ^= split_seed << 17;
+    // Mostly tiny fragments that split every unit, sometimes large ones
+    return 1 + (size_t)(split_seed % (split_seed & 8 ? max : 9));
+}
+
+// Feed compressed data to the fragment decoder in pieces of random size. Returns the number of
+// decompressed bytes, or 0 if the decoder reported an error
+size_t decode_fragments(char* destination, size_t capacity, const char* source, size_t len) {
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_decoder decoder;
+    memlz_decoder_begin(&decoder, state, destination, capacity);
+    size_t pos = 0;
+    int status = MEMLZ_DECODER_MORE;
+    while (status == MEMLZ_DECODER_MORE && pos < len) {
+        size_t n = next_split(len);
+        n = n > len - pos ? len - pos : n;
+        size_t consumed = 0;
+        status = memlz_decoder_feed(&decoder, source + pos, n, &consumed);
+        if(consumed > n) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        pos += consumed;
+    }
+    free(state);
+    return status == MEMLZ_DECODER_DONE ? memlz_decoder_ready(&decoder) : 0;
+}
+
+// Decompress a packet that was read into the end of a buffer of its decompressed length plus
+// the in-place margin. Returns the number of decompressed bytes, or 0 if the decompressor
+// reported an error
+size_t decode_in_place(char* destination, const char* source, size_t len) {
+    size_t decompressed_len = memlz_decompressed_len(source);
+    size_t buffer_len = decompressed_len + memlz_in_place_margin(decompressed_len);
+    buffer_len = buffer_len < len ? len : buffer_len;
+    char* buffer = realloc_or_abort(0, buffer_len);
+    memcpy(buffer + buffer_len - len, source, len);
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    size_t ret = memlz_stream_decompress_in_place(buffer, buffer + buffer_len - len, state);
+    if(ret > decompressed_len) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    memcpy(destination, buffer, ret);
+    free(state);
+    free(buffer);
+    return ret;
+}
+
+// Pick a range of at least 1 byte inside len bytes
+void next_range(size_t len, size_t* offset, size_t* range_len) {
+    *offset = (next_split(len) - 1) % len;
+    *range_len = 1 + (next_split(len - *offset) - 1) % (len - *offset);
+}
+
+// Compress the input into a seekable frame with random blocks and decompress ranges of it
+void check_ranges(const char* original, size_t original_len) {
+    if(original_len == 0) {
+        return;
+    }
+    size_t block_len = next_split(original_len);
+    char* frame = realloc_or_abort(0, memlz_max_compressed_len_seekable(original_len, block_len));
+    char* range = realloc_or_abort(0, original_len);
+    if(!memlz_compress_seekable(frame, original, original_len, block_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    for(int i = 0; i < 4; i++) {
+        size_t offset, len;
+        next_range(original_len, &offset, &len);
+        if(memlz_decompress_range(frame, offset, len, range) != len || memcmp(range, original + offset, len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+    }
+    free(range);
+    free(frame);
+}
+
+// Compress the first part of the input, save the state, load it into a new state and compress
+// the rest with both. They must produce the same packet
+void check_resume(const char* original, size_t original_len) {
+    size_t first = original_len ? (next_split(original_len) - 1) % original_len : 0;
+    char* compressed = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* resumed = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* checkpoint = realloc_or_abort(0, memlz_state_save_len(16));
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_state* loaded = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_reset(loaded);
+    memlz_stream_compress(compressed, original, first, state);
+    size_t checkpoint_len = memlz_state_save(state, checkpoint, memlz_state_save_len(16));
+    if(!checkpoint_len || !memlz_state_load(loaded, checkpoint, checkpoint_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    size_t len = memlz_stream_compress(compressed, original + first, original_len - first, state);
+    if(memlz_stream_compress(resumed, original + first, original_len - first, loaded) != len || memcmp(compressed, resumed, len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    free(loaded);
+    free(state);
+    free(checkpoint);
+    free(resumed);
+    free(compressed);
+}
+
+// Load the input as a checkpoint. A state that accepts it must compress like a copy that is
+// saved and loaded again
+void check_checkpoint(const char* source, size_t len) {
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    if(memlz_state_load(state, source, len)) {
+        char* checkpoint = realloc_or_abort(0, memlz_state_save_len(16));
+        memlz_state* copy = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+        memlz_reset(copy);
+        size_t checkpoint_len = memlz_state_save(state, checkpoint, memlz_state_save_len(16));
+        if(!checkpoint_len || !memlz_state_load(copy, checkpoint, checkpoint_len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        char* a = realloc_or_abort(0, memlz_max_compressed_len(len));
+        char* b = realloc_or_abort(0, memlz_max_compressed_len(len));
+        size_t a_len = memlz_stream_compress(a, source, len, state);
+        if(memlz_stream_compress(b, source, len, copy) != a_len || memcmp(a, b, a_len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        free(b);
+        free(a);
+        free(copy);
+        free(checkpoint);
+    }
+    free(state);
+}
+
+// Train a dictionary on pieces of the input and compress each piece as a message with it. The
+// messages must decompress with another state that has the same dictionary loaded
+void check_dictionary(const char* original, size_t original_len) {
+    const void* samples[64];
+    size_t sample_lens[64];
+    size_t count = 0;
+    for(size_t pos = 0; pos < original_len && count < 64; count++) {
+        size_t n = next_split(original_len - pos);
+        n = n > original_len - pos ? original_len - pos : n;
+        samples[count] = original + pos;
+        sample_lens[count] = n;
+        pos += n;
+    }
+    int bits = 10 + (int)((next_split(7) - 1) % 7);
+    size_t dictionary_len = memlz_dictionary_len(bits);
+    char* dictionary = realloc_or_abort(0, dictionary_len);
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, memlz_state_size_bits(bits));
+    memlz_state* decoder = (memlz_state*)realloc_or_abort(0, memlz_state_size_bits(bits));
+    if(memlz_train_dictionary(dictionary, dictionary_len, samples, sample_lens, count, bits) != dictionary_len
+        || !memlz_state_load_dictionary(state, dictionary, dictionary_len) || !memlz_state_load_dictionary(decoder, dictionary, dictionary_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    for(size_t i = 0; i < count; i++) {
+        char* compressed = realloc_or_abort(0, memlz_max_compressed_len(sample_lens[i]));
+        char* decompressed = realloc_or_abort(0, sample_lens[i]);
+        memlz_compress_with_state(compressed, samples[i], sample_lens[i], state);
+        if(memlz_compressed_dictionary_id(compressed) != memlz_dictionary_id(dictionary)
+            || memlz_decompress_with_state(decompressed, compressed, decoder) != sample_lens[i] || memcmp(decompressed, samples[i], sample_lens[i])) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        free(decompressed);
+        free(compressed);
+    }
+    free(decoder);
+    free(state);
+    free(dictionary);
+}
+
+// Load the input as a dictionary. If it is accepted, the input must compress and decompress
+// with it
+void check_dictionary_input(const char* source, size_t len) {
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, memlz_state_size_bits(16));
+    memlz_state* decoder = (memlz_state*)realloc_or_abort(0, memlz_state_size_bits(16));
+    if(memlz_state_load_dictionary(state, source, len)) {
+        char* compressed = realloc_or_abort(0, memlz_max_compressed_len(len));
+        char* decompressed = realloc_or_abort(0, len);
+        memlz_compress_with_state(compressed, source, len, state);
+        if(!memlz_state_load_dictionary(decoder, source, len) || memlz_decompress_with_state(decompressed, compressed, decoder) != len || memcmp(decompressed, source, len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        free(decompressed);
+        free(compressed);
+    }
+    free(decoder);
+    free(state);
+}
+
+// Compress the input as a packet with a checksum and decompress it, then again with one byte of
+// the packet changed. The changed packet must either be rejected or decompress to the input
+void check_checksum(const char* original, size_t original_len) {
+    char* compressed = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* decompressed = realloc_or_abort(0, original_len + 1);
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_set_checksum(state, 1);
+    size_t compressed_len = memlz_stream_compress(compressed, original, original_len, state);
+    memlz_reset(state);
+    if(!memlz_compressed_checksum(compressed) || memlz_stream_decompress(decompressed, compressed, state) != original_len || memcmp(decompressed, original, original_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    size_t pos = (next_split(compressed_len) - 1) % compressed_len;
+    compressed[pos] ^= (char)next_split(255);
+    if(memlz_decompressed_len(compressed) <= original_len) {
+        memlz_reset(state);
+        size_t ret = memlz_stream_decompress(decompressed, compressed, state);
+        if(ret && (ret != original_len || memcmp(decompressed, original, original_len))) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+    }
+    free(state);
+    free(decompressed);
+    free(compressed);
+}
+
+// Compress the input from segments of random size, some of them empty, twice in a stream. The
+// packets must be identical to those of the input in one buffer
+void check_segments(const char* original, size_t original_len) {
+    memlz_iovec segments[16];
+    size_t count = 0;
+    for(size_t pos = 0; count < 16 && (pos < original_len || count == 0); count++) {
+        size_t n = next_split(original_len - pos + 1) - 1;
+        n = n > original_len - pos || count == 15 ? original_len - pos : n;
+        segments[count].iov_base = (void*)(original + pos);
+        segments[count].iov_len = n;
+        pos += n;
+    }
+    char* a = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* b = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_state* vectored = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_reset(vectored);
+    for(int i = 0; i < 2; i++) {
+        size_t a_len = memlz_stream_compress(a, original, original_len, state);
+        if(memlz_stream_compressv(b, segments, count, vectored) != a_len || memcmp(a, b, a_len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+    }
+    free(vectored);
+    free(state);
+    free(b);
+    free(a);
+}
+
+// Compress the input into a destination of random capacity, which is exactly as large as that
+// so that writes past it are caught. The output must fit and decompress to the input, and it
+// must exist if the capacity is at least memlz_stored_len()
+void check_bounded(const char* original, size_t original_len) {
+    size_t stored_len = memlz_stored_len(original_len);
+    size_t capacity = next_split(memlz_max_compressed_len(original_len) + 1) - 1;
+    capacity = next_split(4) == 1 ? stored_len - (next_split(2) - 1) % 2 : capacity;
+    char* compressed = realloc_or_abort(0, capacity ? capacity : 1);
+    char* decompressed = realloc_or_abort(0, original_len + 1);
+    size_t ret = memlz_compress_bounded(compressed, capacity, original, original_len);
+    if(ret > capacity || (capacity >= stored_len && !ret)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    if(ret && (memlz_compressed_len(compressed) != ret || memlz_decompress(decompressed, compressed) != original_len || memcmp(decompressed, original, original_len))) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    free(decompressed);
+    free(compressed);
+}
+
+// Compress the input with a random filter and stride as two packets of a stream, and then twice
+// as a message with a state that is reused. Each must decompress to its input
+void check_filter(const char* original, size_t original_len) {
+    static const int filters[] = { MEMLZ_FILTER_DELTA, MEMLZ_FILTER_XOR, MEMLZ_FILTER_SHUFFLE, MEMLZ_FILTER_DELTA | MEMLZ_FILTER_SHUFFLE, MEMLZ_FILTER_XOR | MEMLZ_FILTER_SHUFFLE };
+    int filter = filters[(next_split(5) - 1) % 5];
+    size_t stride = 1 + (next_split(255) - 1) % 255;
+    size_t first = original_len ? (next_split(original_len) - 1) % original_len : 0;
+    char* compressed = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* decompressed = realloc_or_abort(0, original_len + 1);
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_state* decoder = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_reset(decoder);
+    if(!memlz_set_filter(state, filter, stride)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    size_t pieces[4] = { 0, first, original_len, original_len };
+    for(int i = 0; i < 3; i++) {
+        size_t len = pieces[i + 1] - pieces[i];
+        memlz_stream_compress(compressed, original + pieces[i], len, state);
+        if(memlz_stream_decompress(decompressed, compressed, decoder) != len || memcmp(decompressed, original + pieces[i], len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+    }
+    memlz_reset(state);
+    memlz_reset(decoder);
+    memlz_set_filter(state, filter, stride);
+    for(int i = 0; i < 2; i++) {
+        memlz_compress_with_state(compressed, original, original_len, state);
+        if(memlz_decompress_with_state(decompressed, compressed, decoder) != original_len || memcmp(decompressed, original, original_len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+    }
+    free(decoder);
+    free(state);
+    free(decompressed);
+    free(compressed);
+}
+
+// Compress pieces of the input as a batch, with the defaults and with a random table size and
+// checksum. With the defaults each message must be identical to that of memlz_compress(), and
+// the batch must decompress to the pieces
+void check_batch(const char* original, size_t original_len) {
+    void* sources[32];
+    void* destinations[32];
+    void* decompressed[32];
+    size_t lens[32];
+    size_t compressed_lens[32];
+    size_t decompressed_lens[32];
+    size_t count = 0;
+    for(size_t pos = 0; count < 32 && (pos < original_len || count == 0); count++) {
+        size_t n = next_split(original_len - pos + 1) - 1;
+        n = n > original_len - pos || count == 31 ? original_len - pos : n;
+        sources[count] = (void*)(original + pos);
+        lens[count] = n;
+        destinations[count] = realloc_or_abort(0, memlz_max_compressed_len(n));
+        decompressed[count] = realloc_or_abort(0, n + 1);
+        pos += n;
+    }
+    char* single = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    memlz_batch_options options = { 0, 0, 0, 0, MEMLZ_FILTER_NONE, 0 };
+    for(int round = 0; round < 2; round++) {
+        if(!memlz_compress_batch(destinations, (const void* const*)sources, lens, count, compressed_lens, round ? &options : 0)
+            || memlz_decompress_batch(decompressed, (const void* const*)destinations, count, decompressed_lens, 0) != count) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        for(size_t i = 0; i < count; i++) {
+            if(decompressed_lens[i] != lens[i] || memcmp(decompressed[i], sources[i], lens[i])) {
+                fprintf(stderr, "crashing at line %d\n", __LINE__);
+                abort();
+            }
+            if(!round && (memlz_compress(single, sources[i], lens[i]) != compressed_lens[i] || memcmp(single, destinations[i], compressed_lens[i]))) {
+                fprintf(stderr, "crashing at line %d\n", __LINE__);
+                abort();
+            }
+        }
+        options.table_bits = 10 + (int)((next_split(7) - 1) % 7);
+        options.checksum = next_split(2) & 1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        free(decompressed[i]);
+        free(destinations[i]);
+    }
+    free(single);
+}
+
+// Compress a buffer with copies of the input at the start of pages and at a random offset with
+// long range matching, so that the copies become references to earlier pages. It must
+// decompress to the buffer, also with the fragment decoder and in place
+void check_long_range(const char* original, size_t original_len) {
+    size_t page = 4096;
+    size_t stride = (original_len + page - 1) / page * page;
+    stride = stride ? stride : page;
+    size_t shift = (next_split(page) - 1) % page;
+    size_t len = 3 * stride + shift;
+    char* data = realloc_or_abort(0, len);
+    memset(data, 0, len);
+    memcpy(data, original, original_len);
+    memcpy(data + stride, original, original_len);
+    memcpy(data + 2 * stride + shift, original, original_len);
+    char* compressed = realloc_or_abort(0, memlz_max_compressed_len(len));
+    char* decompressed = realloc_or_abort(0, len);
+    memlz_state* state = (memlz_state*)realloc_or_abort(0, sizeof(memlz_state));
+    memlz_reset(state);
+    memlz_set_long_range(state, 1);
+    size_t compressed_len = memlz_stream_compress(compressed, data, len, state);
+    if(memlz_decompress(decompressed, compressed) != len || memcmp(decompressed, data, len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    memset(decompressed, 0, len);
+    if(decode_fragments(decompressed, len, compressed, compressed_len) != len || memcmp(decompressed, data, len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    memset(decompressed, 0, len);
+    if(decode_in_place(decompressed, compressed, compressed_len) != len || memcmp(decompressed, data, len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    free(state);
+    free(decompressed);
+    free(compressed);
+    free(data);
+}
+
+// Compress the input as two packets with states of a pool, and the second time with recycled
+// states that memlz_reset() was called on. They must compress like a state that is reset with
+// the table size of the pool. Then both states are idle, and the input must still compress
+// and decompress after that
+void check_pool(const char* original, size_t original_len) {
+    int bits = 10 + (int)((next_split(7) - 1) % 7);
+    size_t first = original_len ? (next_split(original_len) - 1) % original_len : 0;
+    size_t pieces[3] = { 0, first, original_len };
+    char* a = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* b = realloc_or_abort(0, memlz_max_compressed_len(original_len));
+    char* decompressed = realloc_or_abort(0, original_len + 1);
+    memlz_state* reference = (memlz_state*)realloc_or_abort(0, memlz_state_size_bits(bits));
+    memlz_pool* pool = memlz_pool_create(bits, next_split(2) & 1 ? MEMLZ_POOL_HUGE_PAGES : 0);
+    if(!pool) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+    for(int round = 0; round < 2; round++) {
+        memlz_state* state = memlz_pool_acquire(pool);
+        memlz_state* decoder = memlz_pool_acquire(pool);
+        if(!state || !decoder) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        if(round) {
+            memlz_reset(state);
+            memlz_reset(decoder);
+        }
+        memlz_reset_bits(reference, bits);
+        for(int i = 0; i < 2; i++) {
+            size_t len = pieces[i + 1] - pieces[i];
+            size_t a_len = memlz_stream_compress(a, original + pieces[i], len, reference);
+            if(memlz_stream_compress(b, original + pieces[i], len, state) != a_len || memcmp(a, b, a_len)
+                || memlz_stream_decompress(decompressed, b, decoder) != len || memcmp(decompressed, original + pieces[i], len)) {
+                fprintf(stderr, "crashing at line %d\n", __LINE__);
+                abort();
+            }
+        }
+        memlz_pool_idle(pool, state);
+        memlz_pool_idle(pool, decoder);
+        memlz_stream_compress(b, original, original_len, state);
+        if(memlz_stream_decompress(decompressed, b, decoder) != original_len || memcmp(decompressed, original, original_len)) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        memlz_pool_release(pool, decoder);
+        memlz_pool_release(pool, state);
+    }
+    memlz_pool_destroy(pool);
+    free(reference);
+    free(decompressed);
+    free(b);
+    free(a);
+}
+
 void afl_round(int argc, char* argv[], char** original, char** compressed, char** decompressed) {
     *original = realloc_or_abort(*original, max_original_len);
     size_t original_len = fread(*original, 1, max_original_len, stdin);
@@ -66,8 +540,37 @@ void afl_round(int argc, char* argv[], char** original, char** compressed, char*
         abort();
     }
 
+    split_seed = original_len * 0x9E3779B97F4A7C15ull + (original_len ? (unsigned char)(*original)[0] : 0) + 1;
+    memset(*decompressed, 0, original_len);
+    if(decode_fragments(*decompressed, original_len, *compressed, compressed_len) != original_len || memcmp(*original, *decompressed, original_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+
+    memset(*decompressed, 0, original_len);
+    if(decode_in_place(*decompressed, *compressed, compressed_len) != original_len || memcmp(*original, *decompressed, original_len)) {
+        fprintf(stderr, "crashing at line %d\n", __LINE__);
+        abort();
+    }
+
+    check_ranges(*original, original_len);
+    check_resume(*original, original_len);
+    check_dictionary(*original, original_len);
+    check_checksum(*original, original_len);
+    check_segments(*original, original_len);
+    check_bounded(*original, original_len);
+    check_filter(*original, original_len);
+    check_batch(*original, original_len);
+    check_long_range(*original, original_len);
+    check_pool(*original, original_len);
+
     fprintf(stderr, "roundtrip ok\n");
 
+    // Checkpoints and dictionaries are not packets, so stdin is tried as them before it is
+    // checked as a packet
+    check_checkpoint(*original, original_len);
+    check_dictionary_input(*original, original_len);
+
     if(original_len < memlz_header_len()) {
         fprintf(stderr, "stdin detected as invalid\n");    
         return;
@@ -105,6 +608,32 @@ void afl_round(int argc, char* argv[], char** original, char** compressed, char*
         else {
             fprintf(stderr, "stdin detected as invalid\n");            
         }
+
+        // The fragment decoder must not read or write out of bounds, and where both decoders
+        // accept the packet they must agree
+        char* fragmented = realloc_or_abort(0, decompressed_len);
+        size_t got = decode_fragments(fragmented, decompressed_len, *original, original_len);
+        if(got && ret && (got != ret || memcmp(fragmented, *decompressed, ret))) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+
+        // The same for in-place decompression
+        got = decode_in_place(fragmented, *original, original_len);
+        if(got && ret && (got != ret || memcmp(fragmented, *decompressed, ret))) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+
+        // And for a range of stdin as a seekable frame
+        size_t offset, len;
+        next_range(decompressed_len, &offset, &len);
+        got = memlz_decompress_range(*original, offset, len, fragmented);
+        if(got && (got != len || (ret && memcmp(fragmented, *decompressed + offset, len)))) {
+            fprintf(stderr, "crashing at line %d\n", __LINE__);
+            abort();
+        }
+        free(fragmented);
     }
 }
 